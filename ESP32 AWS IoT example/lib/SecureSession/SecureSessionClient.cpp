@@ -0,0 +1,375 @@
+#include "SecureSessionClient.h"
+#include <WiFi.h>
+#include <lwip/sockets.h>
+#include <mbedtls/net_sockets.h>
+#include <esp_heap_caps.h>
+
+/***** the heap peak of a handshake is the drop of the free heap, mbedTLS allocates from it through calloc *****/
+
+static size_t freeHeap()
+{
+  return heap_caps_get_free_size(MALLOC_CAP_8BIT);
+}
+
+SecureSessionClient::SecureSessionClient()
+    : caCert_(nullptr), cert_(nullptr), key_(nullptr), timeoutMs_(5000), configured_(false), host_(nullptr),
+      fd_(-1), open_(false), peeked_(-1), hasSession_(false), lastResumed_(false), lastHandshakeMs_(0),
+      lastHeapPeak_(0), fullHandshakes_(0), resumedHandshakes_(0), lastError_(0)
+{
+  mbedtls_entropy_init(&entropy_);
+  mbedtls_ctr_drbg_init(&drbg_);
+  mbedtls_ssl_config_init(&conf_);
+  mbedtls_x509_crt_init(&caChain_);
+  mbedtls_x509_crt_init(&ownCert_);
+  mbedtls_pk_init(&ownKey_);
+  mbedtls_ssl_init(&ssl_);
+  mbedtls_ssl_session_init(&session_);
+}
+
+SecureSessionClient::~SecureSessionClient()
+{
+  stop();
+  mbedtls_ssl_session_free(&session_);
+  mbedtls_ssl_free(&ssl_);
+  mbedtls_pk_free(&ownKey_);
+  mbedtls_x509_crt_free(&ownCert_);
+  mbedtls_x509_crt_free(&caChain_);
+  mbedtls_ssl_config_free(&conf_);
+  mbedtls_ctr_drbg_free(&drbg_);
+  mbedtls_entropy_free(&entropy_);
+}
+
+int SecureSessionClient::connect(IPAddress ip, uint16_t port)
+{
+  host_ = nullptr;
+  return start(ip, port);
+}
+
+int SecureSessionClient::connect(const char *host, uint16_t port)
+{
+  IPAddress ip;
+  if (!WiFi.hostByName(host, ip))
+  {
+    lastError_ = MBEDTLS_ERR_NET_UNKNOWN_HOST;
+    return 0;
+  }
+  host_ = host;
+  return start(ip, port);
+}
+
+int SecureSessionClient::start(IPAddress ip, uint16_t port)
+{
+  if (open_)
+    stop();
+  if (!configure())
+    return 0;
+  uint32_t connectStarted = millis();
+  fd_ = connectSocket(ip, port);
+  if (fd_ < 0)
+  {
+    lastError_ = MBEDTLS_ERR_NET_CONNECT_FAILED;
+    return 0;
+  }
+  open_ = true;
+
+  // Other tasks allocate too, so this is an upper bound of what the handshake used
+  size_t heapBase = freeHeap();
+  size_t heapLow = heapBase;
+  size_t lowWater = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  uint32_t started = millis();
+  // The I/O buffers are allocated here, they count towards the peak
+  int ret = mbedtls_ssl_setup(&ssl_, &conf_);
+  if (ret == 0 && host_ != nullptr)
+    ret = mbedtls_ssl_set_hostname(&ssl_, host_);
+  if (ret == 0 && hasSession_)
+    ret = mbedtls_ssl_set_session(&ssl_, &session_);
+  if (ret != 0)
+  {
+    lastError_ = ret;
+    release();
+    return 0;
+  }
+  mbedtls_ssl_set_bio(&ssl_, &fd_, bioSend, bioRecv, nullptr);
+
+  bool ok = handshake(connectStarted, heapLow);
+  lastHandshakeMs_ = millis() - started;
+  // Buffers freed within a step are only seen by the low-water mark, if this handshake moved it
+  size_t low = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  if (low < lowWater && low < heapLow)
+    heapLow = low;
+  lastHeapPeak_ = heapBase - heapLow;
+  if (!ok)
+  {
+    // A rejected session falls back to a full handshake by itself, anything but a timeout
+    // may be caused by the stored session though
+    if (lastError_ != MBEDTLS_ERR_SSL_TIMEOUT)
+      clearSession();
+    release();
+    return 0;
+  }
+  if (lastResumed_)
+    resumedHandshakes_++;
+  else
+    fullHandshakes_++;
+  // Copies the session with the ticket the server sent in this handshake
+  hasSession_ = mbedtls_ssl_get_session(&ssl_, &session_) == 0;
+  log_i("TLS %s handshake in %u ms, heap peak %u", lastResumed_ ? "resumed" : "full", lastHandshakeMs_, lastHeapPeak_);
+  return 1;
+}
+
+/* Driven step by step to see whether the server sent its certificate: an abbreviated
+ * handshake goes from ServerHello straight to ChangeCipherSpec. The timeout counts from
+ * the start of the TCP connect.
+ */
+bool SecureSessionClient::handshake(uint32_t started, size_t &heapLow)
+{
+  lastResumed_ = true;
+  while (ssl_.state != MBEDTLS_SSL_HANDSHAKE_OVER)
+  {
+    if (ssl_.state == MBEDTLS_SSL_SERVER_CERTIFICATE)
+      lastResumed_ = false;
+    int ret = mbedtls_ssl_handshake_step(&ssl_);
+    size_t heap = freeHeap();
+    if (heap < heapLow)
+      heapLow = heap;
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+    {
+      if (millis() - started > timeoutMs_)
+      {
+        lastError_ = MBEDTLS_ERR_SSL_TIMEOUT;
+        return false;
+      }
+      delay(1);
+    }
+    else if (ret != 0)
+    {
+      lastError_ = ret;
+      return false;
+    }
+  }
+  lastError_ = 0;
+  return true;
+}
+
+bool SecureSessionClient::configure()
+{
+  if (configured_)
+    return true;
+  if (caCert_ == nullptr)
+  {
+    lastError_ = MBEDTLS_ERR_X509_CERT_VERIFY_FAILED;
+    return false;
+  }
+  int ret = mbedtls_ctr_drbg_seed(&drbg_, mbedtls_entropy_func, &entropy_, nullptr, 0);
+  if (ret == 0)
+    ret = mbedtls_x509_crt_parse(&caChain_, (const unsigned char *)caCert_, strlen(caCert_) + 1);
+  if (ret == 0 && cert_ != nullptr && key_ != nullptr)
+  {
+    ret = mbedtls_x509_crt_parse(&ownCert_, (const unsigned char *)cert_, strlen(cert_) + 1);
+    if (ret == 0)
+      ret = mbedtls_pk_parse_key(&ownKey_, (const unsigned char *)key_, strlen(key_) + 1, nullptr, 0);
+  }
+  if (ret == 0)
+    ret = mbedtls_ssl_config_defaults(&conf_, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM, MBEDTLS_SSL_PRESET_DEFAULT);
+  if (ret == 0)
+  {
+    mbedtls_ssl_conf_authmode(&conf_, MBEDTLS_SSL_VERIFY_REQUIRED);
+    mbedtls_ssl_conf_ca_chain(&conf_, &caChain_, nullptr);
+    mbedtls_ssl_conf_rng(&conf_, mbedtls_ctr_drbg_random, &drbg_);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&conf_, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    if (cert_ != nullptr && key_ != nullptr)
+      ret = mbedtls_ssl_conf_own_cert(&conf_, &ownCert_, &ownKey_);
+  }
+  lastError_ = ret;
+  configured_ = ret == 0;
+  return configured_;
+}
+
+int SecureSessionClient::connectSocket(IPAddress ip, uint16_t port)
+{
+  int fd = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (fd < 0)
+    return -1;
+  // Non-blocking for good, mbedTLS gets WANT_READ / WANT_WRITE; only the connect is waited for
+  lwip_fcntl(fd, F_SETFL, lwip_fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = (uint32_t)ip;
+  if (lwip_connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+  {
+    lwip_close(fd);
+    return -1;
+  }
+  fd_set fds;
+  FD_ZERO(&fds);
+  FD_SET(fd, &fds);
+  struct timeval tv;
+  tv.tv_sec = timeoutMs_ / 1000;
+  tv.tv_usec = (timeoutMs_ % 1000) * 1000;
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (lwip_select(fd + 1, nullptr, &fds, nullptr, &tv) <= 0 ||
+      lwip_getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+  {
+    lwip_close(fd);
+    return -1;
+  }
+  int one = 1;
+  lwip_setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+int SecureSessionClient::bioSend(void *ctx, const unsigned char *buf, size_t len)
+{
+  int ret = lwip_send(*(int *)ctx, buf, len, 0);
+  if (ret >= 0)
+    return ret;
+  return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_WRITE : MBEDTLS_ERR_NET_SEND_FAILED;
+}
+
+int SecureSessionClient::bioRecv(void *ctx, unsigned char *buf, size_t len)
+{
+  int ret = lwip_recv(*(int *)ctx, buf, len, 0);
+  if (ret > 0)
+    return ret;
+  if (ret == 0)
+    return MBEDTLS_ERR_NET_CONN_RESET;
+  return errno == EAGAIN || errno == EWOULDBLOCK ? MBEDTLS_ERR_SSL_WANT_READ : MBEDTLS_ERR_NET_RECV_FAILED;
+}
+
+size_t SecureSessionClient::write(const uint8_t *buf, size_t size)
+{
+  size_t written = 0;
+  uint32_t started = millis();
+  while (open_ && written < size)
+  {
+    int ret = mbedtls_ssl_write(&ssl_, buf + written, size - written);
+    if (ret > 0)
+      written += ret;
+    else if ((ret == MBEDTLS_ERR_SSL_WANT_WRITE || ret == MBEDTLS_ERR_SSL_WANT_READ) && millis() - started < timeoutMs_)
+      delay(1);
+    else
+    {
+      lastError_ = ret;
+      release();
+    }
+  }
+  return written;
+}
+
+int SecureSessionClient::available()
+{
+  if (!open_)
+    return 0;
+  int pending = peeked_ >= 0 ? 1 : 0;
+  // Zero length read: processes incoming records without consuming data
+  int ret = mbedtls_ssl_read(&ssl_, nullptr, 0);
+  if (ret < 0 && ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+  {
+    lastError_ = ret;
+    release();
+    return pending;
+  }
+  return pending + mbedtls_ssl_get_bytes_avail(&ssl_);
+}
+
+int SecureSessionClient::read(uint8_t *buf, size_t size)
+{
+  if (size == 0)
+    return 0;
+  size_t n = 0;
+  if (peeked_ >= 0)
+  {
+    buf[n++] = peeked_;
+    peeked_ = -1;
+  }
+  if (n == size || !open_)
+    return n > 0 ? n : -1;
+  int ret = mbedtls_ssl_read(&ssl_, buf + n, size - n);
+  if (ret > 0)
+    return n + ret;
+  if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+  {
+    lastError_ = ret;
+    release();
+  }
+  return n > 0 ? n : -1;
+}
+
+int SecureSessionClient::read()
+{
+  uint8_t b;
+  return read(&b, 1) == 1 ? b : -1;
+}
+
+int SecureSessionClient::peek()
+{
+  if (peeked_ < 0)
+  {
+    uint8_t b;
+    if (read(&b, 1) == 1)
+      peeked_ = b;
+  }
+  return peeked_;
+}
+
+uint8_t SecureSessionClient::connected()
+{
+  if (open_ && peeked_ < 0)
+    available();
+  return open_;
+}
+
+void SecureSessionClient::stop()
+{
+  if (open_)
+    mbedtls_ssl_close_notify(&ssl_);
+  release();
+}
+
+/***** the session stays for the next connect, the context and its buffers are freed *****/
+void SecureSessionClient::release()
+{
+  if (fd_ >= 0)
+  {
+    lwip_close(fd_);
+    fd_ = -1;
+  }
+  mbedtls_ssl_free(&ssl_);
+  mbedtls_ssl_init(&ssl_);
+  open_ = false;
+  peeked_ = -1;
+}
+
+size_t SecureSessionClient::saveSession(uint8_t *buf, size_t size, size_t *needed) const
+{
+  size_t len = 0;
+  // Sets len to the size it needs when the buffer is too small
+  int ret = hasSession_ ? mbedtls_ssl_session_save(&session_, buf, size, &len) : 0;
+  if (needed)
+    *needed = len;
+  if (!hasSession_ || ret != 0)
+    return 0;
+  return len;
+}
+
+// Fails for a session saved by a different mbedTLS build or configuration
+bool SecureSessionClient::loadSession(const uint8_t *buf, size_t size)
+{
+  clearSession();
+  hasSession_ = mbedtls_ssl_session_load(&session_, buf, size) == 0;
+  if (!hasSession_)
+    clearSession();
+  return hasSession_;
+}
+
+void SecureSessionClient::clearSession()
+{
+  mbedtls_ssl_session_free(&session_);
+  mbedtls_ssl_session_init(&session_);
+  hasSession_ = false;
+}
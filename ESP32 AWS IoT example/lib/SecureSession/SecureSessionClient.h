@@ -0,0 +1,98 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Client.h>
+#include <mbedtls/ssl.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
+#include <mbedtls/x509_crt.h>
+#include <mbedtls/pk.h>
+
+/***** TLS client that resumes its session on reconnect *****/
+
+/* WiFiClientSecure runs a full handshake, certificate chain and ECDHE included, on every
+ * connect. This client keeps the negotiated session (ticket or session ID) and offers it
+ * on the next connect, so a flapping link costs an abbreviated handshake. The session can
+ * be saved and loaded to survive a restart. Handshake time and the largest drop in free heap
+ * during it are recorded for each connect.
+ *
+ * The socket is non-blocking, but connect() waits for the TCP connection and the handshake:
+ * together they take at most the connect timeout, 5 s by default.
+ */
+class SecureSessionClient : public Client
+{
+public:
+  SecureSessionClient();
+  ~SecureSessionClient();
+
+  // PEM strings, kept by pointer and parsed on the first connect
+  void setCACert(const char *pem) { caCert_ = pem; }
+  void setCertificate(const char *pem) { cert_ = pem; }
+  void setPrivateKey(const char *pem) { key_ = pem; }
+  // Bounds TCP connect and handshake together, and each write
+  void setConnectTimeout(uint32_t ms) { timeoutMs_ = ms; }
+
+  int connect(IPAddress ip, uint16_t port) override;
+  int connect(const char *host, uint16_t port) override;
+  size_t write(uint8_t b) override { return write(&b, 1); }
+  size_t write(const uint8_t *buf, size_t size) override;
+  int available() override;
+  int read() override;
+  int read(uint8_t *buf, size_t size) override;
+  int peek() override;
+  void flush() override {}
+  void stop() override;
+  uint8_t connected() override;
+  operator bool() override { return connected(); }
+
+  // Serialized session, 0 if there is none or it does not fit. needed gets the serialized size
+  // of the session, also when it does not fit
+  size_t saveSession(uint8_t *buf, size_t size, size_t *needed = nullptr) const;
+  bool loadSession(const uint8_t *buf, size_t size);
+  void clearSession();
+  bool hasSession() const { return hasSession_; }
+
+  // Last handshake: resumed or full, duration and heap peak
+  bool lastResumed() const { return lastResumed_; }
+  uint32_t lastHandshakeMs() const { return lastHandshakeMs_; }
+  size_t lastHeapPeak() const { return lastHeapPeak_; }
+  uint32_t fullHandshakes() const { return fullHandshakes_; }
+  uint32_t resumedHandshakes() const { return resumedHandshakes_; }
+  int lastError() const { return lastError_; }
+
+private:
+  const char *caCert_;
+  const char *cert_;
+  const char *key_;
+  uint32_t timeoutMs_;
+  bool configured_;
+  const char *host_;
+
+  int fd_;
+  bool open_;
+  int peeked_;
+  mbedtls_entropy_context entropy_;
+  mbedtls_ctr_drbg_context drbg_;
+  mbedtls_ssl_config conf_;
+  mbedtls_x509_crt caChain_;
+  mbedtls_x509_crt ownCert_;
+  mbedtls_pk_context ownKey_;
+  mbedtls_ssl_context ssl_;
+  mbedtls_ssl_session session_;
+  bool hasSession_;
+
+  bool lastResumed_;
+  uint32_t lastHandshakeMs_;
+  size_t lastHeapPeak_;
+  uint32_t fullHandshakes_;
+  uint32_t resumedHandshakes_;
+  int lastError_;
+
+  bool configure();
+  int start(IPAddress ip, uint16_t port);
+  int connectSocket(IPAddress ip, uint16_t port);
+  bool handshake(uint32_t started, size_t &heapLow);
+  void release();
+  static int bioSend(void *ctx, const unsigned char *buf, size_t len);
+  static int bioRecv(void *ctx, unsigned char *buf, size_t len);
+};
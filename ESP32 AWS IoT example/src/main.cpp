@@ -1,74 +1,100 @@
 #include <Arduino.h>
 #include "MyCredentials.h"
-#include <WiFiClientSecure.h>
+#include "SecureSessionClient.h"
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
 #include "WiFi.h"
+#include "ConnectivityManager.h"
+#include <esp_rom_crc.h>
 
 #define AWS_IOT_PUBLISH_TOPIC "esp32/pub"
 #define AWS_IOT_SUBSCRIBE_TOPIC "esp32/sub"
-
-WiFiClientSecure net = WiFiClientSecure();
+#define PUBLISH_INTERVAL 5000
+
+#define TLS_CONNECT_TIMEOUT 5000
+#define MQTT_CONNACK_TIMEOUT 5 // seconds
+
+/* The TLS session is resumed on reconnect and kept in RTC memory that is not initialized
+ * at boot, so it survives deep sleep, software and watchdog resets. A power cycle leaves
+ * garbage there, which the marker and CRC reject.
+ * The Arduino core builds mbedTLS with MBEDTLS_SSL_KEEP_PEER_CERTIFICATE, so the session
+ * carries the server certificate besides the ticket and can be larger than 2 KB. Its size
+ * is logged when it is stored, half of the 8 KB RTC slow memory leaves room for it.
+ */
+#define TLS_SESSION_SIZE 4096
+#define TLS_SESSION_MAGIC 0x544c5331
+struct StoredSession
+{
+  uint32_t magic;
+  uint32_t length;
+  uint32_t crc;
+  uint8_t data[TLS_SESSION_SIZE];
+};
+RTC_NOINIT_ATTR StoredSession tlsSession;
+
+SecureSessionClient net;
 PubSubClient client(net);
+ConnectivityManager connectivity(5000, 5 * 60 * 1000);
 
 void messageHandler(char *topic, byte *payload, unsigned int length);
 
-void connectAWS()
+void storeSession()
 {
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-
-  Serial.println("Connecting to Wi-Fi");
-
-  while (WiFi.status() != WL_CONNECTED)
+  size_t needed = 0;
+  size_t length = net.saveSession(tlsSession.data, sizeof(tlsSession.data), &needed);
+  if (length == 0)
   {
-    delay(500);
-    Serial.print(".");
+    // Without a stored session the next connect does a full handshake
+    tlsSession.magic = 0;
+    if (needed > sizeof(tlsSession.data))
+      Serial.printf("TLS session not stored: %u bytes, room for %u\n", needed, sizeof(tlsSession.data));
+    else
+      Serial.println("TLS session not stored");
+    return;
   }
-  Serial.println(WiFi.localIP());
-  // Configure WiFiClientSecure to use the AWS IoT device credentials
-  net.setCACert(AWS_CERT_CA);
-  net.setCertificate(AWS_CERT_CRT);
-  net.setPrivateKey(AWS_CERT_PRIVATE);
-
-  // Connect to the MQTT broker on the AWS endpoint we defined earlier
-  client.setServer(AWS_IOT_ENDPOINT, 8883);
-
-  // Create a message handler
-  client.setCallback(messageHandler);
+  Serial.printf("TLS session stored: %u of %u bytes\n", length, sizeof(tlsSession.data));
+  tlsSession.length = length;
+  tlsSession.crc = esp_rom_crc32_le(0, tlsSession.data, tlsSession.length);
+  tlsSession.magic = TLS_SESSION_MAGIC;
+}
 
-  Serial.println("Connecting to AWS IOT");
-  while (!client.connected())
+void restoreSession()
+{
+  bool valid = tlsSession.magic == TLS_SESSION_MAGIC && tlsSession.length <= sizeof(tlsSession.data) &&
+               tlsSession.crc == esp_rom_crc32_le(0, tlsSession.data, tlsSession.length);
+  if (!valid || tlsSession.length == 0 || !net.loadSession(tlsSession.data, tlsSession.length))
   {
-    if (client.connect(THINGNAME))
-    {
-      Serial.println("Connected.");
-    }
-    else
-    {
-      Serial.print("Failed. Error state=");
-      Serial.print(client.state());
-      // Wait 5 seconds before retrying
-      delay(5000);
-    }
+    tlsSession.magic = 0;
   }
-  /*while (!client.connect(THINGNAME))
-  {
-    Serial.print(".");
-    delay(100);
-    Serial.println(client.connected());
-  }*/
+}
 
-  if (!client.connected())
+/* Wi-Fi and the TLS session to AWS are kept up by the connectivity manager, which retries
+ * with backoff. An attempt blocks loop(): DNS lookup, then TCP connect and TLS handshake for
+ * up to TLS_CONNECT_TIMEOUT, then up to MQTT_CONNACK_TIMEOUT for the broker to answer.
+ * loop() goes on between attempts.
+ */
+bool connectAWS()
+{
+  Serial.println("Connecting to AWS IOT");
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (!client.connect(THINGNAME))
   {
-    Serial.println("AWS IoT Timeout!");
-    return;
+    Serial.print("Failed. Error state=");
+    Serial.print(client.state());
+    Serial.print(" TLS error=");
+    Serial.println(net.lastError());
+    return false;
   }
+  Serial.printf("TLS %s handshake: %u ms, heap peak %u bytes, free heap %u -> %u (full %u, resumed %u)\n",
+                net.lastResumed() ? "resumed" : "full", net.lastHandshakeMs(), net.lastHeapPeak(),
+                freeHeap, ESP.getFreeHeap(), net.fullHandshakes(), net.resumedHandshakes());
+  storeSession();
 
   // Subscribe to a topic
   client.subscribe(AWS_IOT_SUBSCRIBE_TOPIC);
 
   Serial.println("AWS IoT Connected!");
+  return true;
 }
 
 void publishMessage()
@@ -97,16 +123,41 @@ void messageHandler(char *topic, byte *payload, unsigned int length)
 void setup()
 {
   Serial.begin(9600);
-  connectAWS();
+  // Configure the TLS client to use the AWS IoT device credentials
+  net.setCACert(AWS_CERT_CA);
+  net.setCertificate(AWS_CERT_CRT);
+  net.setPrivateKey(AWS_CERT_PRIVATE);
+  net.setConnectTimeout(TLS_CONNECT_TIMEOUT);
+  restoreSession();
+
+  // Connect to the MQTT broker on the AWS endpoint we defined earlier
+  client.setServer(AWS_IOT_ENDPOINT, 8883);
+  client.setSocketTimeout(MQTT_CONNACK_TIMEOUT);
+
+  // Create a message handler
+  client.setCallback(messageHandler);
+
+  connectivity.setService(connectAWS, []()
+                          { return client.connected(); });
+  connectivity.onStateChange([](ConnectivityManager::State from, ConnectivityManager::State to)
+                             { Serial.printf("Connection: %s -> %s\n", ConnectivityManager::stateName(from), ConnectivityManager::stateName(to)); });
+  connectivity.begin(WIFI_SSID, WIFI_PASSWORD);
 }
 
 void loop()
 {
+  static uint32_t lastPublish = 0;
+  connectivity.loop();
+  client.loop();
+  if (!connectivity.connected() || millis() - lastPublish < PUBLISH_INTERVAL)
+  {
+    return;
+  }
+  lastPublish = millis();
+
   Serial.print(F("Humidity: "));
   Serial.print(F("%  Temperature: "));
   Serial.println(F("°C "));
 
   publishMessage();
-  client.loop();
-  delay(5000);
 }
\ No newline at end of file
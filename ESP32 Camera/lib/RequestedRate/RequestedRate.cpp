@@ -0,0 +1,14 @@
+#include "RequestedRate.h"
+#include <stdlib.h>
+#include <string.h>
+
+uint32_t requestedTicksPerFrame(const char *requestLine, uint32_t tickMsec)
+{
+	const char *fps = strstr(requestLine, "fps=");
+	int rate = fps ? atoi(fps + 4) : 0;
+	if (rate <= 0)
+		return 0;
+
+	uint32_t ticks = (1000 / tickMsec + rate / 2) / rate;
+	return ticks > 0 ? ticks : 1;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Ticks between two frames for the rate asked with ?fps=N in an RTSP request line,
+ * rounded to whole ticks of tickMsec and at least one. 0 if the line asks for no rate
+ */
+uint32_t requestedTicksPerFrame(const char *requestLine, uint32_t tickMsec);
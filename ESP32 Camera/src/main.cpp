@@ -6,10 +6,16 @@
 #include <SimStreamer.h>
 #include <OV2640Streamer.h>
 #include <CRtspSession.h>
+#include <lwip/sockets.h>
+#include <esp_timer.h>
+#include <esp_vfs_eventfd.h>
+#include <atomic>
+#include <RequestedRate.h>
 #include "MyCredentials.h"
 
 // Use this URL to connect the RTSP stream, replace the IP address with the address of your device
 // rtsp://192.168.1.5:8554/mjpeg/1
+// Append ?fps=N for a lower frame rate on that stream, e.g. rtsp://192.168.1.5:8554/mjpeg/1?fps=5
 
 /** Forward dedclaration of the task handling RTSP */
 void rtspTask(void *pvParameters);
@@ -18,21 +24,77 @@ void initRTSP(void);
 /** Task handle of the RTSP task */
 TaskHandle_t rtspTaskHandler;
 
-/** WiFi server for RTSP */
-WiFiServer rtspServer(8554);
+/** Port of the RTSP server */
+#define RTSP_PORT 8554
+/** Maximum number of concurrent RTSP clients */
+#define MAX_RTSP_SESSIONS 4
+/** Interval of the frame tick shared by all streams, 50ms => 20fps, the highest rate a stream gets */
+#define TICK_MSEC 50
+/** Ticks between two frames of a stream that does not ask for a rate with ?fps=N in its URL */
+#define DEFAULT_TICKS_PER_FRAME 1
 
-/** Stream for the camera video */
-CStreamer *streamer = NULL;
-/** Session to handle the RTSP communication */
-CRtspSession *session = NULL;
-/** Client to handle the RTSP connection */
-WiFiClient rtspClient;
+/** Listening socket of the RTSP server */
+int rtspServerSocket = -1;
+/** Event written by the frame tick and stopRTSP to wake up the RTSP task,
+ *  created once and never closed because the tick callback may still write to it */
+int rtspEventFd = -1;
+/** Periodic timer of the shared frame tick, created once and kept */
+esp_timer_handle_t tickTimer = NULL;
+/** Set by the tick timer, cleared by rtspTask */
+std::atomic<bool> tickPending(false);
+/** Time of the last tick in microseconds */
+std::atomic<int64_t> tickTime(0);
+/** Ticks that came while rtspTask had not served the previous one yet */
+std::atomic<uint32_t> rtspTickMisses(0);
+/** Ticks served by rtspTask */
+uint32_t rtspTick = 0;
+
+/**
+ * Streamer that sends the frame captured once per tick by rtspTask,
+ * so all sessions share one capture
+ */
+class SharedFrameStreamer : public CStreamer
+{
+public:
+	SharedFrameStreamer(SOCKET aClient, OV2640 &cam) : CStreamer(aClient, cam.getWidth(), cam.getHeight()), m_cam(cam) {}
+
+	void streamImage(uint32_t curMsec) override
+	{
+		streamFrame(m_cam.getfb(), m_cam.getSize(), curMsec);
+	}
+
+private:
+	OV2640 &m_cam;
+};
+
+/** Client, stream and session state of one RTSP connection, only used by rtspTask */
+struct RtspConnection
+{
+	/** Client to handle the RTSP connection */
+	WiFiClient client;
+	/** Stream for the camera video */
+	SharedFrameStreamer *streamer;
+	/** Session to handle the RTSP communication */
+	CRtspSession *session;
+	/** Ticks between two frames of this stream */
+	uint32_t ticksPerFrame;
+	/** Tick of the last frame sent */
+	uint32_t lastTick;
+	/** Frames sent later than half a tick after their tick */
+	uint32_t deadlineMisses;
+};
+
+/** Active RTSP connections, NULL if the slot is free */
+RtspConnection *rtspConnections[MAX_RTSP_SESSIONS] = {};
+/** Deadline misses of all closed connections */
+uint32_t rtspDeadlineMisses = 0;
 /** Flag from main loop to stop the RTSP server */
-boolean stopRTSPtask = false;
+volatile boolean stopRTSPtask = false;
 OV2640 cam;
 
 void setup()
 {
+	Serial.begin(115200);
 	cam.init(esp32cam_aithinker_config);
 	WiFi.mode(WIFI_STA);
 	WiFi.begin(STASSID, STAPSK);
@@ -65,73 +127,246 @@ void initRTSP(void)
 void stopRTSP(void)
 {
 	stopRTSPtask = true;
+	uint64_t event = 1;
+	write(rtspEventFd, &event, sizeof(event));
+}
+
+/**
+ * Called by esp_timer at each frame tick. Only touches globals that are never freed,
+ * so a connection can be torn down while it runs
+ */
+void onFrameTick(void *arg)
+{
+	tickTime = esp_timer_get_time();
+	// rtspTask did not get to the previous tick
+	if (tickPending.exchange(true))
+		rtspTickMisses++;
+	uint64_t event = 1;
+	write(rtspEventFd, &event, sizeof(event));
+}
+
+/**
+ * Takes the frame rate of a stream from ?fps=N in the URL of its request line,
+ * peeked before the session reads the request. The rate is rounded to whole ticks
+ */
+void readRequestedRate(RtspConnection *connection)
+{
+	char request[128];
+	int length = recv(connection->client.fd(), request, sizeof(request) - 1, MSG_PEEK | MSG_DONTWAIT);
+	if (length <= 0)
+		return;
+
+	request[length] = '\0';
+	char *lineEnd = strstr(request, "\r\n");
+	if (lineEnd)
+		*lineEnd = '\0';
+	uint32_t ticks = requestedTicksPerFrame(request, TICK_MSEC);
+	if (ticks > 0)
+		connection->ticksPerFrame = ticks;
+}
+
+/**
+ * Opens the non-blocking listening socket of the RTSP server
+ */
+bool startRTSPServer(void)
+{
+	rtspServerSocket = socket(AF_INET, SOCK_STREAM, 0);
+	if (rtspServerSocket < 0)
+		return false;
+
+	int enable = 1;
+	setsockopt(rtspServerSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+	struct sockaddr_in address = {};
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = INADDR_ANY;
+	address.sin_port = htons(RTSP_PORT);
+	if (bind(rtspServerSocket, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(rtspServerSocket, MAX_RTSP_SESSIONS) < 0)
+	{
+		close(rtspServerSocket);
+		rtspServerSocket = -1;
+		return false;
+	}
+
+	fcntl(rtspServerSocket, F_SETFL, O_NONBLOCK);
+
+	// Selectable event so the frame tick can wake up the task
+	if (rtspEventFd < 0)
+	{
+		esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+		esp_vfs_eventfd_register(&config);
+		rtspEventFd = eventfd(0, 0);
+	}
+	if (!tickTimer)
+	{
+		esp_timer_create_args_t timerArgs = {};
+		timerArgs.callback = onFrameTick;
+		timerArgs.name = "frame tick";
+		esp_timer_create(&timerArgs, &tickTimer);
+	}
+	return rtspEventFd >= 0 && tickTimer;
+}
+
+/**
+ * Accepts a pending connection into a free slot,
+ * refuses it if all slots are in use
+ */
+void acceptRTSPConnection(void)
+{
+	int clientSocket = accept(rtspServerSocket, NULL, NULL);
+	if (clientSocket < 0)
+		return;
+
+	for (int i = 0; i < MAX_RTSP_SESSIONS; i++)
+	{
+		if (!rtspConnections[i])
+		{
+			RtspConnection *connection = new RtspConnection();
+			connection->client = WiFiClient(clientSocket);
+			connection->streamer = new SharedFrameStreamer(&connection->client, cam); // our streamer for UDP/TCP based RTP transport
+			connection->session = new CRtspSession(&connection->client, connection->streamer); // our threads RTSP session and state
+			connection->ticksPerFrame = DEFAULT_TICKS_PER_FRAME;
+			rtspConnections[i] = connection;
+			return;
+		}
+	}
+
+	// No free slot
+	close(clientSocket);
+}
+
+/**
+ * Tears down one RTSP connection and frees its slot
+ */
+void closeRTSPConnection(int i)
+{
+	RtspConnection *connection = rtspConnections[i];
+	rtspDeadlineMisses += connection->deadlineMisses;
+	Serial.printf("RTSP client closed: %u late frames, %u in total, %u missed ticks\n",
+				  connection->deadlineMisses, rtspDeadlineMisses, rtspTickMisses.load());
+	delete connection->session;
+	delete connection->streamer;
+	connection->client.stop();
+	delete connection;
+	rtspConnections[i] = NULL;
 }
 
 /**
  * The task that handles RTSP connections
  * Starts the RTSP server
- * Handles requests in an endless loop
- * until a stop request is received because OTA
- * starts
+ * Sleeps in select() until a request, a new connection,
+ * the shared frame tick or a stop request
+ * arrives, in an endless loop until a stop request
+ * is received because OTA starts
  */
 void rtspTask(void *pvParameters)
 {
-	uint32_t msecPerFrame = 50;
-	static uint32_t lastimage = millis();
-
-	// rtspServer.setNoDelay(true);
-	rtspServer.setTimeout(1);
-	rtspServer.begin();
+	if (!startRTSPServer())
+	{
+		vTaskDelete(NULL);
+		return;
+	}
 
-	while (1)
+	while (!stopRTSPtask)
 	{
-		// If we have an active client connection, just service that until gone
-		if (session)
+		fd_set readSockets;
+		FD_ZERO(&readSockets);
+		FD_SET(rtspServerSocket, &readSockets);
+		FD_SET(rtspEventFd, &readSockets);
+		int maxSocket = rtspServerSocket > rtspEventFd ? rtspServerSocket : rtspEventFd;
+		for (int i = 0; i < MAX_RTSP_SESSIONS; i++)
 		{
-			session->handleRequests(0); // we don't use a timeout here,
-			// instead we send only if we have new enough frames
-
-			uint32_t now = millis();
-			if (now > lastimage + msecPerFrame || now < lastimage)
-			{ // handle clock rollover
-				session->broadcastCurrentFrame(now);
-				lastimage = now;
-			}
-
-			// Handle disconnection from RTSP client
-			if (session->m_stopped)
+			if (rtspConnections[i])
 			{
-				delete session;
-				delete streamer;
-				session = NULL;
-				streamer = NULL;
+				int clientSocket = rtspConnections[i]->client.fd();
+				FD_SET(clientSocket, &readSockets);
+				if (clientSocket > maxSocket)
+					maxSocket = clientSocket;
 			}
 		}
-		else
+
+		if (select(maxSocket + 1, &readSockets, NULL, NULL, NULL) <= 0)
+			continue;
+
+		if (FD_ISSET(rtspEventFd, &readSockets))
+		{
+			uint64_t events;
+			read(rtspEventFd, &events, sizeof(events));
+		}
+
+		if (FD_ISSET(rtspServerSocket, &readSockets))
+			acceptRTSPConnection();
+
+		for (int i = 0; i < MAX_RTSP_SESSIONS; i++)
+		{
+			RtspConnection *connection = rtspConnections[i];
+			if (!connection || !FD_ISSET(connection->client.fd(), &readSockets))
+				continue;
+
+			// The rate is taken from the requests up to PLAY
+			if (!connection->session->m_streaming)
+				readRequestedRate(connection);
+			connection->session->handleRequests(0);
+		}
+
+		// One capture per tick, sent to every stream that is due on this tick
+		if (tickPending.exchange(false))
 		{
-			rtspClient = rtspServer.accept();
-			// Handle connection request from RTSP client
-			if (rtspClient)
+			rtspTick++;
+			bool captured = false;
+			for (int i = 0; i < MAX_RTSP_SESSIONS; i++)
 			{
-				streamer = new OV2640Streamer(&rtspClient, cam); // our streamer for UDP/TCP based RTP transport
+				RtspConnection *connection = rtspConnections[i];
+				if (!connection || !connection->session->m_streaming || rtspTick - connection->lastTick < connection->ticksPerFrame)
+					continue;
 
-				session = new CRtspSession(&rtspClient, streamer); // our threads RTSP session and state
-				delay(100);
+				connection->lastTick = rtspTick;
+				if (!captured)
+				{
+					cam.run();
+					captured = true;
+				}
+				connection->session->broadcastCurrentFrame(millis());
+				if (esp_timer_get_time() - tickTime > TICK_MSEC * 500LL)
+					connection->deadlineMisses++;
 			}
 		}
-		if (stopRTSPtask)
+
+		bool streaming = false;
+		for (int i = 0; i < MAX_RTSP_SESSIONS; i++)
 		{
-			// User requested RTSP server stop
-			if (rtspClient)
+			RtspConnection *connection = rtspConnections[i];
+			if (!connection)
+				continue;
+
+			// Handle disconnection from RTSP client
+			if (connection->session->m_stopped)
 			{
-				delete session;
-				delete streamer;
-				session = NULL;
-				streamer = NULL;
+				closeRTSPConnection(i);
+				continue;
 			}
-			// Delete this task
-			vTaskDelete(NULL);
+
+			streaming = streaming || connection->session->m_streaming;
 		}
-		delay(10);
+
+		// The tick only runs while a client is playing
+		bool tickActive = esp_timer_is_active(tickTimer);
+		if (streaming && !tickActive)
+			esp_timer_start_periodic(tickTimer, TICK_MSEC * 1000ULL);
+		else if (!streaming && tickActive)
+			esp_timer_stop(tickTimer);
 	}
+
+	// User requested RTSP server stop, e.g. for OTA
+	esp_timer_stop(tickTimer);
+	for (int i = 0; i < MAX_RTSP_SESSIONS; i++)
+	{
+		if (rtspConnections[i])
+			closeRTSPConnection(i);
+	}
+	close(rtspServerSocket);
+	rtspServerSocket = -1;
+
+	// Delete this task
+	vTaskDelete(NULL);
 }
@@ -0,0 +1,61 @@
+#include <unity.h>
+#include <RequestedRate.h>
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_no_rate()
+{
+	TEST_ASSERT_EQUAL_UINT32(0, requestedTicksPerFrame("DESCRIBE rtsp://192.168.1.5:8554/mjpeg/1 RTSP/1.0", 50));
+	TEST_ASSERT_EQUAL_UINT32(0, requestedTicksPerFrame("", 50));
+}
+
+void test_invalid_rate()
+{
+	TEST_ASSERT_EQUAL_UINT32(0, requestedTicksPerFrame("DESCRIBE rtsp://cam/mjpeg/1?fps=0 RTSP/1.0", 50));
+	TEST_ASSERT_EQUAL_UINT32(0, requestedTicksPerFrame("DESCRIBE rtsp://cam/mjpeg/1?fps=-5 RTSP/1.0", 50));
+	TEST_ASSERT_EQUAL_UINT32(0, requestedTicksPerFrame("DESCRIBE rtsp://cam/mjpeg/1?fps=x RTSP/1.0", 50));
+}
+
+void test_rate_in_whole_ticks()
+{
+	// 20 ticks per second at 50 ms
+	TEST_ASSERT_EQUAL_UINT32(1, requestedTicksPerFrame("DESCRIBE rtsp://cam/mjpeg/1?fps=20 RTSP/1.0", 50));
+	TEST_ASSERT_EQUAL_UINT32(4, requestedTicksPerFrame("DESCRIBE rtsp://cam/mjpeg/1?fps=5 RTSP/1.0", 50));
+	TEST_ASSERT_EQUAL_UINT32(20, requestedTicksPerFrame("DESCRIBE rtsp://cam/mjpeg/1?fps=1 RTSP/1.0", 50));
+}
+
+void test_rate_is_rounded_to_the_nearest_tick()
+{
+	// 20 / 3 = 6.7 ticks
+	TEST_ASSERT_EQUAL_UINT32(7, requestedTicksPerFrame("DESCRIBE rtsp://cam/mjpeg/1?fps=3 RTSP/1.0", 50));
+	// 20 / 6 = 3.3 ticks
+	TEST_ASSERT_EQUAL_UINT32(3, requestedTicksPerFrame("DESCRIBE rtsp://cam/mjpeg/1?fps=6 RTSP/1.0", 50));
+}
+
+void test_rate_above_the_tick_rate()
+{
+	TEST_ASSERT_EQUAL_UINT32(1, requestedTicksPerFrame("DESCRIBE rtsp://cam/mjpeg/1?fps=60 RTSP/1.0", 50));
+}
+
+void test_rate_among_other_parameters()
+{
+	TEST_ASSERT_EQUAL_UINT32(2, requestedTicksPerFrame("SETUP rtsp://cam/mjpeg/1?res=vga&fps=10 RTSP/1.0", 50));
+}
+
+int main()
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_no_rate);
+	RUN_TEST(test_invalid_rate);
+	RUN_TEST(test_rate_in_whole_ticks);
+	RUN_TEST(test_rate_is_rounded_to_the_nearest_tick);
+	RUN_TEST(test_rate_above_the_tick_rate);
+	RUN_TEST(test_rate_among_other_parameters);
+	return UNITY_END();
+}
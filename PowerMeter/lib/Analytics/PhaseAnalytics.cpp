@@ -0,0 +1,100 @@
+#include "PhaseAnalytics.h"
+#include <math.h>
+#include <string.h>
+
+PhaseAnalytics::PhaseAnalytics(float sagVoltage, float swellVoltage, float hysteresis, uint32_t demandWindowMs)
+    : sagVoltage_(sagVoltage), swellVoltage_(swellVoltage), hysteresis_(hysteresis), demandWindowMs_(demandWindowMs),
+      last_(), peakDemand_(0), windowStart_(0), windowSum_(0), windowCount_(0),
+      inEvent_(false), event_(), eventStartMs_(0), eventHead_(0), eventCount_(0)
+{
+}
+
+void PhaseAnalytics::add(const Measurement &m, uint32_t nowMs)
+{
+  voltage.add(m.voltage);
+  current.add(m.current);
+  power.add(m.power);
+  frequency.add(m.frequency);
+  pf.add(m.pf);
+  last_ = m;
+
+  // Block average of the power over the demand window
+  if (windowCount_ > 0 && nowMs - windowStart_ >= demandWindowMs_)
+  {
+    float demand = windowSum_ / windowCount_;
+    if (demand > peakDemand_)
+      peakDemand_ = demand;
+    windowCount_ = 0;
+  }
+  if (windowCount_ == 0)
+  {
+    windowStart_ = nowMs;
+    windowSum_ = 0;
+  }
+  windowSum_ += m.power;
+  windowCount_++;
+
+  updateEvent(m, nowMs);
+}
+
+void PhaseAnalytics::reset()
+{
+  voltage.reset();
+  current.reset();
+  power.reset();
+  frequency.reset();
+  pf.reset();
+  peakDemand_ = 0;
+}
+
+Measurement PhaseAnalytics::mean() const
+{
+  Measurement m = last_;
+  // Rounded to the 0.1 resolution of the meter
+  m.voltage = roundf(voltage.mean() * 10) / 10;
+  m.current = current.mean();
+  m.power = roundf(power.mean() * 10) / 10;
+  m.frequency = roundf(frequency.mean() * 10) / 10;
+  m.pf = pf.mean();
+  return m;
+}
+
+bool PhaseAnalytics::pollEvent(PowerEvent &event)
+{
+  if (eventCount_ == 0)
+    return false;
+  event = events_[(eventHead_ + MAX_EVENTS - eventCount_) % MAX_EVENTS];
+  eventCount_--;
+  return true;
+}
+
+void PhaseAnalytics::updateEvent(const Measurement &m, uint32_t nowMs)
+{
+  float v = m.voltage;
+  if (!inEvent_)
+  {
+    if (v >= sagVoltage_ && v <= swellVoltage_)
+      return;
+    inEvent_ = true;
+    event_.type = v < sagVoltage_ ? PowerEvent::SAG : PowerEvent::SWELL;
+    memcpy(event_.phase, m.phase, sizeof(event_.phase));
+    event_.start = m.timestamp;
+    event_.extreme = v;
+    eventStartMs_ = nowMs;
+    return;
+  }
+
+  if (event_.type == PowerEvent::SAG ? v < event_.extreme : v > event_.extreme)
+    event_.extreme = v;
+  bool back = event_.type == PowerEvent::SAG ? v >= sagVoltage_ + hysteresis_ : v <= swellVoltage_ - hysteresis_;
+  if (!back)
+    return;
+
+  inEvent_ = false;
+  event_.durationMs = nowMs - eventStartMs_;
+  // Oldest event is dropped when nobody collected them
+  events_[eventHead_] = event_;
+  eventHead_ = (eventHead_ + 1) % MAX_EVENTS;
+  if (eventCount_ < MAX_EVENTS)
+    eventCount_++;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include "Measurement.h"
+#include "StreamingStats.h"
+
+/***** Aggregates and voltage events of one phase between two publications *****/
+
+struct PowerEvent
+{
+  enum Type : uint8_t
+  {
+    SAG,
+    SWELL
+  };
+  Type type;
+  char phase[2];
+  uint32_t start;      // timestamp of the first sample outside the limits
+  uint32_t durationMs; // from the first sample outside to the first sample back inside
+  float extreme;       // lowest voltage of a sag, highest of a swell
+};
+
+class PhaseAnalytics
+{
+public:
+  // Nominal 230 V, sag below -10 %, swell above +10 %, 2 V hysteresis to end an event
+  PhaseAnalytics(float sagVoltage = 207, float swellVoltage = 253, float hysteresis = 2, uint32_t demandWindowMs = 1000);
+
+  void add(const Measurement &m, uint32_t nowMs);
+  // Start the next interval, a running event and demand window go on
+  void reset();
+
+  StreamingStats voltage;
+  StreamingStats current;
+  StreamingStats power;
+  StreamingStats frequency;
+  StreamingStats pf;
+  // Interval means as a measurement, with the last energy reading and timestamp
+  Measurement mean() const;
+  // Highest mean power of a demand window in this interval
+  float peakDemand() const { return peakDemand_; }
+
+  // Completed events, oldest first
+  bool pollEvent(PowerEvent &event);
+
+private:
+  static const uint8_t MAX_EVENTS = 8;
+
+  float sagVoltage_;
+  float swellVoltage_;
+  float hysteresis_;
+  uint32_t demandWindowMs_;
+
+  Measurement last_;
+  float peakDemand_;
+  uint32_t windowStart_;
+  float windowSum_;
+  uint32_t windowCount_;
+
+  bool inEvent_;
+  PowerEvent event_;
+  uint32_t eventStartMs_;
+  PowerEvent events_[MAX_EVENTS];
+  uint8_t eventHead_;
+  uint8_t eventCount_;
+
+  void updateEvent(const Measurement &m, uint32_t nowMs);
+};
@@ -0,0 +1,7 @@
+#include "StreamingStats.h"
+#include <math.h>
+
+float StreamingStats::rms() const
+{
+  return count_ > 0 ? sqrt(mean_ * mean_ + m2_ / count_) : 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+/***** Min, max, mean, RMS and variance of a stream in constant memory *****/
+
+/* Mean and variance use Welford's update in double precision, which stays accurate over
+ * long intervals where a plain sum of squares would cancel out. RMS follows from them as
+ * sqrt(mean^2 + population variance), so there is no separate sum of squares.
+ */
+class StreamingStats
+{
+public:
+  StreamingStats() { reset(); }
+
+  void add(float x)
+  {
+    count_++;
+    double delta = x - mean_;
+    mean_ += delta / count_;
+    m2_ += delta * (x - mean_);
+    if (count_ == 1 || x < min_)
+      min_ = x;
+    if (count_ == 1 || x > max_)
+      max_ = x;
+  }
+
+  void reset()
+  {
+    count_ = 0;
+    mean_ = m2_ = 0;
+    min_ = max_ = 0;
+  }
+
+  uint32_t count() const { return count_; }
+  float min() const { return min_; }
+  float max() const { return max_; }
+  float mean() const { return mean_; }
+  float variance() const { return count_ > 1 ? m2_ / (count_ - 1) : 0; }
+  float rms() const;
+
+private:
+  uint32_t count_;
+  double mean_;
+  double m2_;
+  float min_;
+  float max_;
+};
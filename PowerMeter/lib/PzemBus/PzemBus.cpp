@@ -0,0 +1,179 @@
+#include "PzemBus.h"
+#include <time.h>
+
+#define PZEM_BAUD_RATE 9600
+#define CMD_READ_INPUT_REGISTERS 0x04
+#define CMD_RESET_ENERGY 0x42
+#define REGISTER_COUNT 10
+#define RESPONSE_TIMEOUT 100 // ms
+#define SILENCE_TIME 5       // ms, 3.5 characters at 9600 baud are 3.6 ms
+
+PzemBus::PzemBus(HardwareSerial &serial, int rxPin, int txPin)
+    : serial_(serial), rxPin_(rxPin), txPin_(txPin), count_(0), state_(IDLE), current_(0),
+      cycleRunning_(false), resetting_(false), cycleTimestamp_(0), stateStarted_(0), received_(0), expected_(0)
+{
+}
+
+void PzemBus::begin()
+{
+  serial_.begin(PZEM_BAUD_RATE, SERIAL_8N1, rxPin_, txPin_);
+}
+
+bool PzemBus::addMeter(uint8_t address, const char *phase)
+{
+  if (count_ == MAX_METERS)
+    return false;
+  Meter &m = meters_[count_++];
+  m = Meter();
+  m.address = address;
+  strncpy(m.reading.phase, phase, sizeof(m.reading.phase) - 1);
+  return true;
+}
+
+void PzemBus::startCycle()
+{
+  if (cycleRunning_ || count_ == 0)
+    return;
+  cycleRunning_ = true;
+  cycleTimestamp_ = time(nullptr);
+  current_ = 0;
+  for (size_t i = 0; i < count_; i++)
+  {
+    meters_[i].valid = false;
+    meters_[i].resetTried = false;
+  }
+  if (state_ == IDLE)
+    sendNext();
+}
+
+void PzemBus::resetEnergy(uint8_t address)
+{
+  for (size_t i = 0; i < count_; i++)
+    if (meters_[i].address == address)
+      meters_[i].resetPending = true;
+}
+
+bool PzemBus::poll()
+{
+  switch (state_)
+  {
+  case WAIT_RESPONSE:
+    while (serial_.available() && received_ < expected_)
+      response_[received_++] = serial_.read();
+    if (received_ == expected_)
+      finish(crc16(response_, expected_ - 2) == (response_[expected_ - 2] | response_[expected_ - 1] << 8) && response_[0] == meters_[current_].address);
+    else if (millis() - stateStarted_ > RESPONSE_TIMEOUT)
+      finish(false);
+    break;
+
+  case SILENCE:
+    if (millis() - stateStarted_ < SILENCE_TIME)
+      break;
+    state_ = IDLE;
+    if (cycleRunning_ && current_ == count_)
+    {
+      cycleRunning_ = false;
+      return true;
+    }
+    if (cycleRunning_)
+      sendNext();
+    break;
+
+  default:
+    break;
+  }
+  return false;
+}
+
+// A pending reset of the current meter goes first, once per cycle, then its register read
+void PzemBus::sendNext()
+{
+  Meter &m = meters_[current_];
+  uint8_t frame[8] = {m.address};
+  resetting_ = m.resetPending && !m.resetTried;
+  if (resetting_)
+  {
+    m.resetTried = true;
+    frame[1] = CMD_RESET_ENERGY;
+    uint16_t crc = crc16(frame, 2);
+    frame[2] = crc & 0xFF;
+    frame[3] = crc >> 8;
+    send(frame, 4, 4);
+    return;
+  }
+  frame[1] = CMD_READ_INPUT_REGISTERS;
+  frame[2] = 0x00; // first register
+  frame[3] = 0x00;
+  frame[4] = 0x00; // register count
+  frame[5] = REGISTER_COUNT;
+  uint16_t crc = crc16(frame, 6);
+  frame[6] = crc & 0xFF;
+  frame[7] = crc >> 8;
+  send(frame, 8, 5 + 2 * REGISTER_COUNT);
+}
+
+void PzemBus::send(const uint8_t *frame, size_t size, size_t expected)
+{
+  while (serial_.available()) // drop anything left from a timed out response
+    serial_.read();
+  serial_.write(frame, size);
+  received_ = 0;
+  expected_ = expected;
+  state_ = WAIT_RESPONSE;
+  stateStarted_ = millis();
+}
+
+void PzemBus::finish(bool ok)
+{
+  Meter &m = meters_[current_];
+  if (resetting_)
+  {
+    // The read follows after the silence either way; a failed reset is retried next cycle
+    if (ok)
+      m.resetPending = false;
+  }
+  else
+  {
+    if (ok)
+    {
+      decode(m);
+      m.reads++;
+    }
+    else
+    {
+      m.errors++;
+    }
+    m.valid = ok;
+    current_++;
+  }
+  state_ = SILENCE;
+  stateStarted_ = millis();
+}
+
+void PzemBus::decode(Meter &m)
+{
+  const uint8_t *r = response_ + 3;
+  uint32_t reg[REGISTER_COUNT];
+  for (size_t i = 0; i < REGISTER_COUNT; i++)
+    reg[i] = r[2 * i] << 8 | r[2 * i + 1];
+  m.reading.timestamp = cycleTimestamp_;
+  // Full meter resolution for the analytics, the published means are rounded
+  m.reading.voltage = reg[0] / 10.0;
+  m.reading.current = (reg[1] | reg[2] << 16) / 1000.0;
+  m.reading.power = (reg[3] | reg[4] << 16) / 10.0;
+  m.reading.energy = (reg[5] | reg[6] << 16) / 1000.0;
+  m.reading.frequency = reg[7] / 10.0;
+  m.reading.pf = reg[8] / 100.0;
+}
+
+uint16_t PzemBus::crc16(const uint8_t *data, size_t size)
+{
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < size; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  }
+  return crc;
+}
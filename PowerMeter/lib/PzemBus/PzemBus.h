@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Arduino.h>
+#include "Measurement.h"
+
+/***** Polls several PZEM-004T v3 meters on one Modbus RTU bus without blocking *****/
+
+/* Each meter is read with one request for all ten input registers. The bus is half duplex,
+ * so meters are served one after the other, but the next request goes out as soon as the
+ * previous response is in (after the 3.5 character silence Modbus requires) instead of
+ * waiting for the next loop or task tick. All readings of a cycle share its timestamp.
+ */
+class PzemBus
+{
+public:
+  static const size_t MAX_METERS = 3;
+
+  PzemBus(HardwareSerial &serial, int rxPin, int txPin);
+  void begin();
+  bool addMeter(uint8_t address, const char *phase);
+
+  // Read all meters once, from the loop via poll()
+  void startCycle();
+  // Zero the energy counter of a meter, sent before the next read
+  void resetEnergy(uint8_t address);
+  // Advance the bus; true once when a cycle has completed
+  bool poll();
+
+  size_t meterCount() const { return count_; }
+  bool valid(size_t i) const { return meters_[i].valid; }
+  const Measurement &reading(size_t i) const { return meters_[i].reading; }
+  // Successful reads and timeouts or CRC errors per meter, to measure the sample rate
+  uint32_t reads(size_t i) const { return meters_[i].reads; }
+  uint32_t errors(size_t i) const { return meters_[i].errors; }
+
+private:
+  enum State
+  {
+    IDLE,
+    WAIT_RESPONSE,
+    SILENCE
+  };
+
+  struct Meter
+  {
+    uint8_t address;
+    Measurement reading;
+    bool valid;
+    bool resetPending;
+    bool resetTried; // this cycle, a failed reset waits for the next one
+    uint32_t reads;
+    uint32_t errors;
+  };
+
+  HardwareSerial &serial_;
+  int rxPin_;
+  int txPin_;
+  Meter meters_[MAX_METERS];
+  size_t count_;
+
+  State state_;
+  size_t current_;
+  bool cycleRunning_;
+  bool resetting_;
+  uint32_t cycleTimestamp_;
+  uint32_t stateStarted_;
+  uint8_t response_[25];
+  size_t received_;
+  size_t expected_;
+
+  void sendNext();
+  void send(const uint8_t *frame, size_t size, size_t expected);
+  void finish(bool ok);
+  void decode(Meter &m);
+  static uint16_t crc16(const uint8_t *data, size_t size);
+};
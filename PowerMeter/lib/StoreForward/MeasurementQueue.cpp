@@ -0,0 +1,235 @@
+#include "MeasurementQueue.h"
+#include <LittleFS.h>
+
+#define SEGMENT_DIR "/queue"
+#define HEAD_FILE "/queue.head"
+// Single file of the previous layout, removed when the queue starts over
+#define LEGACY_FILE "/queue.bin"
+
+MeasurementQueue::MeasurementQueue(size_t maxRecords)
+    : maxSegments_((maxRecords + SEGMENT_RECORDS - 1) / SEGMENT_RECORDS), first_(0), offset_(0), last_(0),
+      lastRecords_(0), count_(0), dropped_(0)
+{
+  // Dropping the oldest segment must leave one to append to
+  if (maxSegments_ < 2)
+    maxSegments_ = 2;
+}
+
+bool MeasurementQueue::begin()
+{
+  if (!LittleFS.begin(true))
+    return false;
+  LittleFS.mkdir(SEGMENT_DIR);
+
+  State state = {0, 0, 0, 0};
+  File head = LittleFS.open(HEAD_FILE, FILE_READ);
+  if (head)
+  {
+    if (head.read((uint8_t *)&state, sizeof(state)) != sizeof(state))
+      state.format = 0;
+    head.close();
+  }
+  if (state.format != FORMAT || state.first > state.last || state.offset > SEGMENT_RECORDS)
+  {
+    // Unknown state, nothing tells which files belong to the queue
+    removeAll();
+    clear();
+    return true;
+  }
+  first_ = state.first;
+  offset_ = state.offset;
+  last_ = state.last;
+
+  // A segment started after the state was last saved
+  char path[24];
+  for (;;)
+  {
+    segmentPath(last_ + 1, path, sizeof(path));
+    if (!LittleFS.exists(path))
+      break;
+    last_++;
+  }
+  lastRecords_ = segmentRecords(last_);
+  uint64_t records = (uint64_t)(last_ - first_) * SEGMENT_RECORDS + lastRecords_;
+  if (records < offset_)
+  {
+    removeAll();
+    clear();
+    return true;
+  }
+  count_ = records - offset_;
+  return true;
+}
+
+bool MeasurementQueue::push(const Measurement &m)
+{
+  uint32_t segment = last_;
+  uint32_t records = lastRecords_;
+  if (records >= SEGMENT_RECORDS)
+  {
+    segment++;
+    records = 0;
+  }
+
+  Record record;
+  memset(&record, 0, sizeof(record)); // padding bytes are part of the CRC
+  memcpy(&record.measurement, &m, sizeof(m));
+  record.crc = crc32((const uint8_t *)&record.measurement, sizeof(record.measurement));
+
+  char path[24];
+  segmentPath(segment, path, sizeof(path));
+  File file = LittleFS.open(path, FILE_APPEND);
+  if (!file || file.write((const uint8_t *)&record, sizeof(record)) != sizeof(record))
+    return false;
+  file.close();
+
+  // Only a written record changes the queue
+  bool started = segment != last_;
+  last_ = segment;
+  lastRecords_ = records + 1;
+  count_++;
+  if (started)
+  {
+    if (last_ - first_ + 1 > maxSegments_)
+    {
+      // Full: the oldest segment goes with the records not sent from it
+      uint32_t lost = SEGMENT_RECORDS - offset_;
+      dropped_ += lost;
+      count_ -= lost;
+      segmentPath(first_, path, sizeof(path));
+      LittleFS.remove(path);
+      first_++;
+      offset_ = 0;
+    }
+    saveState();
+  }
+  return true;
+}
+
+size_t MeasurementQueue::peek(Measurement *out, size_t count)
+{
+  size_t read = 0;
+  uint32_t segment = first_;
+  uint32_t offset = offset_;
+  char path[24];
+  while (read < count && read < count_)
+  {
+    segmentPath(segment, path, sizeof(path));
+    File file = LittleFS.open(path, FILE_READ);
+    if (!file || !file.seek(offset * sizeof(Record)))
+      break;
+    while (read < count && read < count_ && offset < SEGMENT_RECORDS)
+    {
+      Record record;
+      if (file.read((uint8_t *)&record, sizeof(record)) != sizeof(record))
+        break;
+      // Corrupt records are skipped, they are popped together with the good ones
+      if (record.crc == crc32((const uint8_t *)&record.measurement, sizeof(record.measurement)))
+        out[read] = record.measurement;
+      else
+        out[read].timestamp = 0;
+      read++;
+      offset++;
+    }
+    file.close();
+    // The end of the newest segment, or a short read
+    if (offset < SEGMENT_RECORDS)
+      break;
+    segment++;
+    offset = 0;
+  }
+  return read;
+}
+
+void MeasurementQueue::pop(size_t count)
+{
+  if (count >= count_)
+  {
+    clear();
+    return;
+  }
+  count_ -= count;
+  offset_ += count;
+  char path[24];
+  // Records are left, so a fully sent segment is never the last one
+  while (offset_ >= SEGMENT_RECORDS)
+  {
+    segmentPath(first_, path, sizeof(path));
+    LittleFS.remove(path);
+    first_++;
+    offset_ -= SEGMENT_RECORDS;
+  }
+  saveState();
+}
+
+void MeasurementQueue::saveState()
+{
+  File head = LittleFS.open(HEAD_FILE, FILE_WRITE);
+  if (head)
+  {
+    State state = {FORMAT, first_, offset_, last_};
+    head.write((const uint8_t *)&state, sizeof(state));
+    head.close();
+  }
+}
+
+// Everything sent: the segments go and numbering starts over
+void MeasurementQueue::clear()
+{
+  char path[24];
+  for (uint32_t segment = first_; segment <= last_; segment++)
+  {
+    segmentPath(segment, path, sizeof(path));
+    LittleFS.remove(path);
+  }
+  first_ = offset_ = last_ = lastRecords_ = count_ = 0;
+  saveState();
+}
+
+// Every file in the segment directory and the old single file, for a state that cannot be trusted
+void MeasurementQueue::removeAll()
+{
+  LittleFS.remove(LEGACY_FILE);
+  for (;;)
+  {
+    // Reopened after each removal, removing while iterating may skip entries
+    File dir = LittleFS.open(SEGMENT_DIR);
+    File file = dir ? dir.openNextFile() : File();
+    if (!file)
+      break;
+    String path = file.path();
+    file.close();
+    dir.close();
+    if (!LittleFS.remove(path.c_str()))
+      break;
+  }
+}
+
+void MeasurementQueue::segmentPath(uint32_t segment, char *path, size_t size)
+{
+  snprintf(path, size, SEGMENT_DIR "/%lu", (unsigned long)segment);
+}
+
+uint32_t MeasurementQueue::segmentRecords(uint32_t segment)
+{
+  char path[24];
+  segmentPath(segment, path, sizeof(path));
+  File file = LittleFS.open(path, FILE_READ);
+  if (!file)
+    return 0;
+  uint32_t records = file.size() / sizeof(Record);
+  file.close();
+  return records;
+}
+
+uint32_t MeasurementQueue::crc32(const uint8_t *data, size_t size)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < size; i++)
+  {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+  }
+  return ~crc;
+}
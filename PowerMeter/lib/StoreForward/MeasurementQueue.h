@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Measurement.h"
+
+/***** Measurements kept on LittleFS while the broker is away *****/
+
+/* Records of fixed size are appended to segment files of SEGMENT_RECORDS records, numbered in
+ * order. A segment fits one flash block, so an append rewrites at most that block; writing into
+ * the middle of one large file would make LittleFS rewrite everything after the write point.
+ * Sent segments are deleted whole. The oldest segment number and the records already sent from
+ * it live in a state file. LittleFS commits a file on close, so a power loss in the middle of a
+ * write leaves the previous state; a record CRC guards against anything else. When the queue is
+ * full the oldest segment is dropped.
+ */
+class MeasurementQueue
+{
+public:
+  // One 4 KB LittleFS block of records
+  static const uint32_t SEGMENT_RECORDS = 100;
+
+  // Rounded up to whole segments
+  MeasurementQueue(size_t maxRecords);
+  bool begin();
+
+  bool push(const Measurement &m);
+  // Read up to count records from the head without removing them, returns how many were read.
+  // Corrupt records come back with timestamp 0
+  size_t peek(Measurement *out, size_t count);
+  // Remove records returned by peek once they were sent
+  void pop(size_t count);
+  size_t size() const { return count_; }
+  uint32_t dropped() const { return dropped_; }
+
+private:
+  struct Record
+  {
+    Measurement measurement;
+    uint32_t crc;
+  };
+
+  // Bumped when Record or the file layout changes, a queue in another format is dropped at begin()
+  static const uint32_t FORMAT = 3;
+
+  struct State
+  {
+    uint32_t format;
+    uint32_t first;  // oldest segment
+    uint32_t offset; // records of the oldest segment already sent
+    uint32_t last;   // segment being appended to
+  };
+
+  uint32_t maxSegments_;
+  uint32_t first_;
+  uint32_t offset_;
+  uint32_t last_;
+  uint32_t lastRecords_;
+  uint32_t count_;
+  uint32_t dropped_;
+
+  void saveState();
+  void clear();
+  void removeAll();
+  static void segmentPath(uint32_t segment, char *path, size_t size);
+  static uint32_t segmentRecords(uint32_t segment);
+  static uint32_t crc32(const uint8_t *data, size_t size);
+};
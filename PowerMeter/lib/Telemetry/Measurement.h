@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+/***** One reading of a PZEM meter *****/
+
+struct Measurement
+{
+  uint32_t timestamp; // seconds since epoch once the clock is set
+  float voltage;
+  float current;
+  float power;
+  float energy;
+  float frequency;
+  float pf;
+  char phase[2];
+};
@@ -0,0 +1,61 @@
+#include "TelemetryBatch.h"
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+TelemetryBatch::TelemetryBatch(const char *did, size_t flushCount, uint32_t flushAgeMs)
+    : did_(did), flushCount_(flushCount < CAPACITY ? flushCount : CAPACITY), flushAgeMs_(flushAgeMs), head_(0), count_(0), firstMillis_(0)
+{
+}
+
+void TelemetryBatch::add(const Measurement &m)
+{
+  if (count_ == 0)
+    firstMillis_ = millis();
+  ring_[head_] = m;
+  head_ = (head_ + 1) % CAPACITY;
+  if (count_ < CAPACITY)
+    count_++;
+}
+
+bool TelemetryBatch::due() const
+{
+  return count_ >= flushCount_ || (count_ > 0 && millis() - firstMillis_ >= flushAgeMs_);
+}
+
+size_t TelemetryBatch::encode(uint8_t *buffer, size_t size) const
+{
+  // About 4 KB, static to keep it off the caller's stack, so encode is not reentrant
+  static StaticJsonDocument<JSON_OBJECT_SIZE(11) + 8 * JSON_ARRAY_SIZE(CAPACITY)> doc;
+  doc.clear();
+  doc["did"] = did_;
+  if (count_ > 0)
+    doc["t"] = at(0).timestamp;
+  JsonArray dt = doc.createNestedArray("dt");
+  JsonArray ph = doc.createNestedArray("ph");
+  JsonArray v = doc.createNestedArray("dv");
+  JsonArray ma = doc.createNestedArray("ma");
+  JsonArray w = doc.createNestedArray("dw");
+  JsonArray wh = doc.createNestedArray("wh");
+  JsonArray hz = doc.createNestedArray("dhz");
+  JsonArray pf = doc.createNestedArray("pf");
+  for (size_t i = 0; i < count_; i++)
+  {
+    const Measurement &m = at(i);
+    const Measurement &previous = at(i > 0 ? i - 1 : 0);
+    dt.add(m.timestamp - previous.timestamp);
+    ph.add(m.phase[0] - '0');
+    v.add(lround(m.voltage * 10));
+    ma.add(lround(m.current * 1000));
+    w.add(lround(m.power * 10));
+    long energy = lround(m.energy * 1000);
+    size_t j = i;
+    while (j > 0 && at(j - 1).phase[0] != m.phase[0])
+      j--;
+    wh.add(j > 0 ? energy - lround(at(j - 1).energy * 1000) : energy);
+    hz.add(lround(m.frequency * 10));
+    pf.add(lround(m.pf * 100));
+  }
+  if (measureMsgPack(doc) > size)
+    return 0;
+  return serializeMsgPack(doc, buffer, size);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Measurement.h"
+
+/***** Ring of measurements, flushed as one MessagePack batch *****/
+
+/* The batch is column oriented and sends the device id once:
+ * {"did":"PowerMeter","t":<first timestamp>,"dt":[...],"ph":[...],"dv":[...],"ma":[...],
+ *  "dw":[...],"wh":[...],"dhz":[...],"pf":[...]}
+ * Timestamps are delta encoded against the previous sample. Energy is delta encoded against
+ * the previous sample of the same phase, the first sample of a phase carries the absolute value.
+ * Voltage, power and frequency are in tenths (dV, dW, dHz), the resolution of the meter, current
+ * is in mA, energy in Wh and pf in percent, so almost every value fits a one to three byte integer.
+ */
+class TelemetryBatch
+{
+public:
+  static const size_t CAPACITY = 32;
+
+  TelemetryBatch(const char *did, size_t flushCount, uint32_t flushAgeMs);
+
+  // Oldest sample is overwritten when the ring is full
+  void add(const Measurement &m);
+  // Enough samples or the oldest one waited long enough
+  bool due() const;
+  size_t count() const { return count_; }
+  void clear() { count_ = 0; }
+
+  // Returns the encoded size, 0 if the buffer is too small. Uses a static document, one caller at a time
+  size_t encode(uint8_t *buffer, size_t size) const;
+
+private:
+  const char *did_;
+  size_t flushCount_;
+  uint32_t flushAgeMs_;
+  Measurement ring_[CAPACITY];
+  size_t head_;
+  size_t count_;
+  uint32_t firstMillis_;
+
+  const Measurement &at(size_t i) const { return ring_[(head_ + CAPACITY - count_ + i) % CAPACITY]; }
+};
@@ -9,11 +9,17 @@
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
 #include <WiFi.h>
-#include <PZEM004Tv30.h>
+#include "PzemBus.h"
 #include <TaskScheduler.h>
 #include <ESPmDNS.h>
 #include <WiFiUdp.h>
 #include <ArduinoOTA.h>
+#include <time.h>
+#include "ConnectivityManager.h"
+#include "Measurement.h"
+#include "TelemetryBatch.h"
+#include "MeasurementQueue.h"
+#include "PhaseAnalytics.h"
 #include "MyCredentials.h"
 
 /***** Define devise name for Mdns and DB *****/
@@ -24,123 +30,256 @@
 
 #define IOT_PUBLISH_TOPIC "esp32/pub"
 #define IOT_SUBSCRIBE_TOPIC "esp32/sub"
+#define IOT_BATCH_TOPIC "esp32/pub/batch"
+#define IOT_STATS_TOPIC "esp32/pub/stats"
+#define IOT_EVENT_TOPIC "esp32/pub/event"
+#define IOT_ACK_TOPIC "esp32/pub/ack"
 
 /***** PZEM part *****/
 
 #define PZEM_RX_PIN 16
 #define PZEM_TX_PIN 17
 #define PZEM_SERIAL Serial2
-#define ADDRESS2 0x02
-PZEM004Tv30 pzem2(PZEM_SERIAL, PZEM_RX_PIN, PZEM_TX_PIN, ADDRESS2);
-struct Measurement
-{
-  int voltage;
-  float current;
-  int power;
-  float energy;
-  int frequency;
-  float pf;
-  char phase[2];
+struct MeterConfig
+{
+  uint8_t address;
+  const char *phase;
+};
+const MeterConfig METERS[] = {
+    {0x01, "1"},
+    {0x02, "2"},
+    {0x03, "3"},
 };
+PzemBus meters(PZEM_SERIAL, PZEM_RX_PIN, PZEM_TX_PIN);
+
+/***** Analytics part: the bus is read as fast as it allows, only aggregates and events are sent *****/
+
+PhaseAnalytics analytics[PzemBus::MAX_METERS];
+
+/***** Telemetry part *****/
+
+#define PAYLOAD_JSON 0    // one JSON message per sample on IOT_PUBLISH_TOPIC
+#define PAYLOAD_MSGPACK 1 // MessagePack batches on IOT_BATCH_TOPIC, see TelemetryBatch.h
+#define BATCH_SIZE 12     // 20 s of samples at the 5 s interval, 4 per phase with three meters
+#define BATCH_MAX_AGE (60 * 1000)
+#define MQTT_BUFFER_SIZE 1024
+int payloadFormat = PAYLOAD_MSGPACK;
+TelemetryBatch batch(DID, BATCH_SIZE, BATCH_MAX_AGE);
+
+/***** Store and forward part *****/
 
-/***** WiFi part *****/
+#define QUEUE_MAX_RECORDS 20000 // about 9 hours of three phases at the 5 s interval
+#define DRAIN_BATCH BATCH_SIZE  // records sent per drain run, once a second
+MeasurementQueue queue(QUEUE_MAX_RECORDS);
+
+/***** WiFi part: connecting Wi-Fi never blocks the sampling, see ConnectivityManager.h *****/
 
 WiFiClient net;
+ConnectivityManager connectivity;
 
-/***** MQTT part *****/
+/***** MQTT part: a broker connect attempt stalls the bus for at most the TCP connect timeout (3 s) plus MQTT_CONNACK_TIMEOUT *****/
 
+#define MQTT_CONNACK_TIMEOUT 2 // seconds
 PubSubClient client(net);
 
 /***** declare functions in loop *****/
 
-void myPzem();
-void checkConnections();
+void drainQueue();
 
 /***** declare helper functions *****/
 
-void messageHandler(char *topic, byte *payload, unsigned int length); // not in use now
-void readData(Measurement m, PZEM004Tv30 p, char ph[]);
-void connectWiFi();
-void connectBroker();
-void publishMessage(Measurement m);
+void messageHandler(char *topic, byte *payload, unsigned int length);
+void collectReadings();
+void publishAggregates();
+bool publishStats(size_t i);
+void publishEvents();
+bool connectBroker();
+void connectionChanged(ConnectivityManager::State from, ConnectivityManager::State to);
+bool publishMessage(const Measurement &m);
+void publishMeasurement(const Measurement &m);
+void publishBatch();
 void setupOTA();
 
 /***** Task Scheduler stuff *****/
 
 Scheduler ts;
-Task t0(5 * TASK_SECOND, TASK_FOREVER, &myPzem);
-Task t1(15 * TASK_SECOND, TASK_FOREVER, &checkConnections);
+Task t0(5 * TASK_SECOND, TASK_FOREVER, &publishAggregates);
+Task t2(TASK_SECOND, TASK_FOREVER, &drainQueue);
+
+/***** MQTT command part *****/
+
+/* Commands on IOT_SUBSCRIBE_TOPIC, answered on IOT_ACK_TOPIC:
+ *   {"cmd":"interval","value":10}         publish interval in seconds (1-3600)
+ *   {"cmd":"read"}                        publish the current aggregates now
+ *   {"cmd":"reset_energy","phase":"2"}    zero the energy counter of one phase, all without phase
+ *   {"cmd":"format","value":"msgpack"}    payload format, json or msgpack
+ * The payload is parsed in place in the MQTT buffer into a document on the stack, no heap.
+ * Publishing reuses that buffer, so a handler that publishes must not read its args afterwards.
+ */
+#define COMMAND_JSON_SIZE JSON_OBJECT_SIZE(4)
+typedef bool (*CommandHandler)(JsonVariantConst args);
+struct Command
+{
+  const char *name;
+  CommandHandler handler;
+};
+bool cmdInterval(JsonVariantConst args);
+bool cmdRead(JsonVariantConst args);
+bool cmdResetEnergy(JsonVariantConst args);
+bool cmdFormat(JsonVariantConst args);
+const Command COMMANDS[] = {
+    {"interval", cmdInterval},
+    {"read", cmdRead},
+    {"reset_energy", cmdResetEnergy},
+    {"format", cmdFormat},
+};
 
 void setup()
 {
   Serial.begin(9600);
-  connectWiFi();
-  connectBroker();
+  if (!queue.begin())
+  {
+    Serial.println("LittleFS mount failed, no store and forward");
+  }
+  meters.begin();
+  for (const MeterConfig &meter : METERS)
+  {
+    meters.addMeter(meter.address, meter.phase);
+  }
+  meters.startCycle();
+  configTime(0, 0, "pool.ntp.org");
+  client.setServer(IOT_ENDPOINT, 1883);
+  client.setCallback(messageHandler);
+  client.setBufferSize(MQTT_BUFFER_SIZE);
+  client.setSocketTimeout(MQTT_CONNACK_TIMEOUT);
+  connectivity.setService(connectBroker, []()
+                          { return client.connected(); });
+  connectivity.onStateChange(connectionChanged);
+  connectivity.begin(WIFI_SSID, WIFI_PASSWORD);
   ts.addTask(t0);
-  ts.addTask(t1);
+  ts.addTask(t2);
   t0.enable();
-  t1.enable();
+  t2.enable();
   setupOTA();
 }
 
 void loop()
 {
   ts.execute();
+  connectivity.loop();
+  if (meters.poll())
+  {
+    collectReadings();
+    meters.startCycle();
+  }
   client.loop();
   ArduinoOTA.handle();
 }
 
-/***** Read data from PZEM in TS loop *****/
-void myPzem()
+/***** Feed the readings of a completed cycle into the analytics, the next cycle starts at once *****/
+void collectReadings()
+{
+  uint32_t now = millis();
+  for (size_t i = 0; i < meters.meterCount(); i++)
+  {
+    if (meters.valid(i))
+    {
+      analytics[i].add(meters.reading(i), now);
+    }
+  }
+  publishEvents();
+}
+
+/***** Send the interval means and statistics to broker in TS loop *****/
+void publishAggregates()
 {
-  Measurement msrm2;
-  char tempP[2] = "2";
-  readData(msrm2, pzem2, tempP);
+  for (size_t i = 0; i < meters.meterCount(); i++)
+  {
+    if (analytics[i].voltage.count() == 0)
+    {
+      continue;
+    }
+    publishMeasurement(analytics[i].mean());
+    publishStats(i);
+    analytics[i].reset();
+  }
 }
 
-/***** Read data from PZEM and send to broker *****/
-void readData(Measurement m, PZEM004Tv30 p, char ph[])
+/***** publish min, max, RMS, standard deviation and peak demand of the interval *****/
+bool publishStats(size_t i)
 {
-  m.voltage = round(p.voltage());
-  m.current = p.current();
-  m.power = round(p.power());
-  m.energy = p.energy();
-  m.frequency = round(p.frequency());
-  m.pf = p.pf();
-  strcpy(m.phase, ph);
-  if (!isnan(m.energy))
+  if (!client.connected())
   {
-    publishMessage(m);
+    return false;
+  }
+  const PhaseAnalytics &a = analytics[i];
+  StaticJsonDocument<JSON_OBJECT_SIZE(8) + 3 * JSON_OBJECT_SIZE(5) + 8> doc; // + copy of the phase string
+  doc["did"] = DID;
+  doc["phase"] = a.mean().phase;
+  doc["timestamp"] = a.mean().timestamp;
+  doc["samples"] = a.voltage.count();
+  const char *names[] = {"voltage", "current", "power"};
+  const StreamingStats *stats[] = {&a.voltage, &a.current, &a.power};
+  for (int s = 0; s < 3; s++)
+  {
+    JsonObject o = doc.createNestedObject(names[s]);
+    o["min"] = stats[s]->min();
+    o["max"] = stats[s]->max();
+    o["mean"] = stats[s]->mean();
+    o["rms"] = stats[s]->rms();
+    o["stddev"] = sqrtf(stats[s]->variance());
   }
+  doc["peak_demand"] = a.peakDemand();
+  uint8_t buffer[512];
+  size_t size = payloadFormat == PAYLOAD_JSON ? serializeJson(doc, (char *)buffer, sizeof(buffer)) : serializeMsgPack(doc, buffer, sizeof(buffer));
+  return client.publish(IOT_STATS_TOPIC, buffer, size);
 }
 
-/***** Connect to WiFi *****/
-void connectWiFi()
+/***** publish completed sags and swells, they wait in the analytics while offline *****/
+void publishEvents()
 {
-  WiFi.mode(WIFI_STA);
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-  while (WiFi.status() != WL_CONNECTED)
+  PowerEvent event;
+  for (size_t i = 0; i < meters.meterCount() && client.connected(); i++)
   {
-    delay(500);
-    if (millis() > 15000) ESP.restart();
+    while (analytics[i].pollEvent(event))
+    {
+      StaticJsonDocument<JSON_OBJECT_SIZE(6) + 8> doc;
+      doc["did"] = DID;
+      doc["phase"] = event.phase;
+      doc["type"] = event.type == PowerEvent::SAG ? "sag" : "swell";
+      doc["start"] = event.start;
+      doc["duration_ms"] = event.durationMs;
+      doc["extreme"] = event.extreme;
+      char jsonBuffer[256];
+      serializeJson(doc, jsonBuffer);
+      client.publish(IOT_EVENT_TOPIC, jsonBuffer);
+    }
   }
 }
 
-/***** Connect to broker *****/
-void connectBroker()
+/***** Connect to broker, one attempt, retried by the connectivity manager with backoff *****/
+bool connectBroker()
 {
-  client.setServer(IOT_ENDPOINT, 1883);
-  client.setCallback(messageHandler);
-  while (!client.connected())
+  if (!client.connect(THINGNAME, MQTT_USER, MQTT_PASS))
   {
-      client.connect(THINGNAME, MQTT_USER, MQTT_PASS);
-      delay(500);
+    return false;
   }
   client.subscribe(IOT_SUBSCRIBE_TOPIC);
+  return true;
+}
+
+/***** log connection changes, stored measurements are sent by drainQueue once connected *****/
+void connectionChanged(ConnectivityManager::State from, ConnectivityManager::State to)
+{
+  Serial.printf("Connection: %s -> %s\n", ConnectivityManager::stateName(from), ConnectivityManager::stateName(to));
+  if (to == ConnectivityManager::CONNECTED && connectivity.reconnects() > 0)
+  {
+    Serial.printf("Reconnected in %u ms\n", connectivity.lastReconnectMs());
+  }
 }
 
 /***** publish message *****/
-void publishMessage(Measurement m)
+bool publishMessage(const Measurement &m)
 {
   StaticJsonDocument<200> doc;
   doc["voltage"] = m.voltage;
@@ -151,34 +290,164 @@ void publishMessage(Measurement m)
   doc["pf"] = m.pf;
   doc["did"] = DID;
   doc["phase"] = m.phase;
+  doc["timestamp"] = m.timestamp;
   char jsonBuffer[512];
   serializeJson(doc, jsonBuffer);
-  client.publish(IOT_PUBLISH_TOPIC, jsonBuffer);
+  return client.publish(IOT_PUBLISH_TOPIC, jsonBuffer);
 }
 
-/***** callback (not in use now) *****/
+/***** publish in the selected payload format *****/
+void publishMeasurement(const Measurement &m)
+{
+  if (!client.connected())
+  {
+    queue.push(m);
+    return;
+  }
+  if (payloadFormat == PAYLOAD_JSON)
+  {
+    publishMessage(m);
+    return;
+  }
+  batch.add(m);
+  if (batch.due())
+  {
+    publishBatch();
+  }
+}
+
+/***** publish the batched samples, kept for the next try if the broker is away *****/
+// Shared by publishBatch and drainQueue, both run on the loop task, kept off its 8 KB stack
+uint8_t batchBuffer[MQTT_BUFFER_SIZE - 64]; // room for the MQTT header and topic
+
+void publishBatch()
+{
+  size_t size = batch.encode(batchBuffer, sizeof(batchBuffer));
+  if (size > 0 && client.publish(IOT_BATCH_TOPIC, batchBuffer, size))
+  {
+    batch.clear();
+  }
+}
+
+/***** send stored measurements with their original timestamps in TS loop, one batch per run *****/
+void drainQueue()
+{
+  if (queue.size() == 0 || !client.connected())
+  {
+    return;
+  }
+  static Measurement stored[DRAIN_BATCH];
+  size_t count = queue.peek(stored, DRAIN_BATCH);
+  if (payloadFormat == PAYLOAD_JSON)
+  {
+    // Records go out one message each, the ones published are popped even if a later one fails
+    size_t sent = 0;
+    while (sent < count && (stored[sent].timestamp == 0 || publishMessage(stored[sent])))
+    {
+      sent++;
+    }
+    queue.pop(sent);
+    return;
+  }
+  static TelemetryBatch replay(DID, DRAIN_BATCH, 0);
+  replay.clear();
+  for (size_t i = 0; i < count; i++)
+  {
+    if (stored[i].timestamp != 0)
+    {
+      replay.add(stored[i]);
+    }
+  }
+  size_t size = replay.encode(batchBuffer, sizeof(batchBuffer));
+  // One message for the chunk, popped whole or not at all
+  if (replay.count() == 0 || (size > 0 && client.publish(IOT_BATCH_TOPIC, batchBuffer, size)))
+  {
+    queue.pop(count);
+  }
+}
+
+/***** callback: dispatch a command through the table *****/
 void messageHandler(char *topic, byte *payload, unsigned int length)
-{ /***** test message: "{"message": "Hello, world!"}" *****/
-  Serial.print("incoming topic: ");
-  Serial.println(topic);
-  StaticJsonDocument<200> doc;
-  deserializeJson(doc, payload, length);
-  const char *message = doc["message"];
-  Serial.print("incoming message: ");
-  Serial.println(message);
+{
+  StaticJsonDocument<COMMAND_JSON_SIZE> doc;
+  // char* input: zero-copy, strings point into the payload
+  DeserializationError error = deserializeJson(doc, (char *)payload, length);
+  // Copied out, a handler that publishes overwrites the payload
+  char name[33] = "";
+  if (!error && doc["cmd"].is<const char *>())
+  {
+    strlcpy(name, doc["cmd"], sizeof(name));
+  }
+  bool ok = false;
+  for (const Command &command : COMMANDS)
+  {
+    if (strcmp(command.name, name) == 0)
+    {
+      ok = command.handler(doc.as<JsonVariantConst>());
+      break;
+    }
+  }
+  char ack[96];
+  snprintf(ack, sizeof(ack), "{\"did\":\"%s\",\"cmd\":\"%s\",\"ok\":%s}", DID, name, ok ? "true" : "false");
+  client.publish(IOT_ACK_TOPIC, ack);
 }
 
-/***** check connection to WiFi and broker in TS loop *****/
-void checkConnections()
+/***** commands, applied to the running tasks *****/
+bool cmdInterval(JsonVariantConst args)
 {
-  if (WiFi.status() != WL_CONNECTED)
+  long seconds = args["value"] | 0L;
+  if (seconds < 1 || seconds > 3600)
   {
-    connectWiFi();
+    return false;
   }
-  if (!client.connected())
+  t0.setInterval(seconds * TASK_SECOND);
+  return true;
+}
+
+bool cmdRead(JsonVariantConst args)
+{
+  t0.forceNextIteration();
+  return true;
+}
+
+bool cmdResetEnergy(JsonVariantConst args)
+{
+  const char *phase = args["phase"];
+  bool found = false;
+  for (const MeterConfig &meter : METERS)
+  {
+    if (phase == nullptr || strcmp(phase, meter.phase) == 0)
+    {
+      meters.resetEnergy(meter.address);
+      found = true;
+    }
+  }
+  return found;
+}
+
+bool cmdFormat(JsonVariantConst args)
+{
+  const char *format = args["value"];
+  if (format == nullptr)
+  {
+    return false;
+  }
+  if (strcmp(format, "json") == 0)
+  {
+    // Samples waiting for a batch go out before the switch; this publish overwrites args
+    if (payloadFormat == PAYLOAD_MSGPACK && batch.count() > 0)
+    {
+      publishBatch();
+    }
+    payloadFormat = PAYLOAD_JSON;
+    return true;
+  }
+  if (strcmp(format, "msgpack") == 0)
   {
-    connectBroker();
+    payloadFormat = PAYLOAD_MSGPACK;
+    return true;
   }
+  return false;
 }
 
 /***** Setup OTA *****/
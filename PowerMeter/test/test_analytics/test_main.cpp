@@ -0,0 +1,146 @@
+#include <unity.h>
+#include <math.h>
+#include <string.h>
+#include "StreamingStats.h"
+#include "PhaseAnalytics.h"
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_empty_stats()
+{
+  StreamingStats s;
+  TEST_ASSERT_EQUAL_INT(0, s.count());
+  TEST_ASSERT_FLOAT_WITHIN(0, 0, s.mean());
+  TEST_ASSERT_FLOAT_WITHIN(0, 0, s.variance());
+  TEST_ASSERT_FLOAT_WITHIN(0, 0, s.rms());
+}
+
+void test_mean_variance_min_max()
+{
+  StreamingStats s;
+  const float values[] = {2, 4, 4, 4, 5, 5, 7, 9};
+  for (float v : values)
+    s.add(v);
+  TEST_ASSERT_EQUAL_INT(8, s.count());
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, 5, s.mean());
+  // Sample variance, 32 / 7
+  TEST_ASSERT_FLOAT_WITHIN(1e-5, 32.0 / 7, s.variance());
+  TEST_ASSERT_FLOAT_WITHIN(0, 2, s.min());
+  TEST_ASSERT_FLOAT_WITHIN(0, 9, s.max());
+}
+
+void test_rms_of_a_sine()
+{
+  // One period of a 230 V RMS sine
+  StreamingStats s;
+  const int n = 1000;
+  for (int i = 0; i < n; i++)
+    s.add(230 * sqrt(2) * sin(2 * M_PI * i / n));
+  TEST_ASSERT_FLOAT_WITHIN(1e-3, 0, s.mean());
+  TEST_ASSERT_FLOAT_WITHIN(1e-3, 230, s.rms());
+}
+
+void test_rms_with_offset()
+{
+  // sqrt(mean^2 + population variance) of -1 and 3 is sqrt((1 + 9) / 2)
+  StreamingStats s;
+  s.add(-1);
+  s.add(3);
+  TEST_ASSERT_FLOAT_WITHIN(1e-6, sqrt(5), s.rms());
+}
+
+void test_variance_stays_accurate_on_a_large_offset()
+{
+  // 230 V with +-0.1 V of noise over a day of 1 s samples, a float sum of squares would lose it
+  StreamingStats s;
+  for (int i = 0; i < 86400; i++)
+    s.add(i % 2 ? 230.1f : 229.9f);
+  TEST_ASSERT_FLOAT_WITHIN(1e-3, 230, s.mean());
+  TEST_ASSERT_FLOAT_WITHIN(1e-4, 0.01, s.variance());
+}
+
+void test_reset_stats()
+{
+  StreamingStats s;
+  s.add(100);
+  s.reset();
+  s.add(-5);
+  TEST_ASSERT_EQUAL_INT(1, s.count());
+  TEST_ASSERT_FLOAT_WITHIN(0, -5, s.min());
+  TEST_ASSERT_FLOAT_WITHIN(0, -5, s.max());
+  TEST_ASSERT_FLOAT_WITHIN(0, 0, s.variance());
+}
+
+static Measurement sample(uint32_t timestamp, float voltage, float power)
+{
+  Measurement m;
+  memset(&m, 0, sizeof(m));
+  m.timestamp = timestamp;
+  m.voltage = voltage;
+  m.power = power;
+  m.frequency = 50;
+  strcpy(m.phase, "1");
+  return m;
+}
+
+void test_mean_is_rounded_to_tenths()
+{
+  PhaseAnalytics phase;
+  phase.add(sample(1, 230.04f, 100.06f), 0);
+  phase.add(sample(2, 230.10f, 100.10f), 1000);
+  Measurement m = phase.mean();
+  TEST_ASSERT_FLOAT_WITHIN(1e-4, 230.1f, m.voltage);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4, 100.1f, m.power);
+  TEST_ASSERT_EQUAL_INT(2, m.timestamp);
+}
+
+void test_sag_event_with_hysteresis()
+{
+  PhaseAnalytics phase;
+  phase.add(sample(10, 230, 0), 0);
+  phase.add(sample(11, 200, 0), 1000);
+  phase.add(sample(12, 195, 0), 2000);
+  // Above the sag limit but within the hysteresis, the sag goes on
+  phase.add(sample(13, 208, 0), 3000);
+  PowerEvent event;
+  TEST_ASSERT_FALSE(phase.pollEvent(event));
+  phase.add(sample(14, 230, 0), 4000);
+  TEST_ASSERT_TRUE(phase.pollEvent(event));
+  TEST_ASSERT_EQUAL_INT(PowerEvent::SAG, event.type);
+  TEST_ASSERT_EQUAL_INT(11, event.start);
+  TEST_ASSERT_EQUAL_INT(3000, event.durationMs);
+  TEST_ASSERT_FLOAT_WITHIN(0, 195, event.extreme);
+  TEST_ASSERT_FALSE(phase.pollEvent(event));
+}
+
+void test_peak_demand()
+{
+  PhaseAnalytics phase(207, 253, 2, 1000);
+  phase.add(sample(1, 230, 100), 0);
+  phase.add(sample(1, 230, 300), 500);
+  // Closes the first window, mean 200
+  phase.add(sample(2, 230, 50), 1000);
+  phase.add(sample(3, 230, 50), 2000);
+  TEST_ASSERT_FLOAT_WITHIN(1e-4, 200, phase.peakDemand());
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_stats);
+  RUN_TEST(test_mean_variance_min_max);
+  RUN_TEST(test_rms_of_a_sine);
+  RUN_TEST(test_rms_with_offset);
+  RUN_TEST(test_variance_stays_accurate_on_a_large_offset);
+  RUN_TEST(test_reset_stats);
+  RUN_TEST(test_mean_is_rounded_to_tenths);
+  RUN_TEST(test_sag_event_with_hysteresis);
+  RUN_TEST(test_peak_demand);
+  return UNITY_END();
+}
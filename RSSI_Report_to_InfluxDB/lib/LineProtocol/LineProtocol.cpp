@@ -0,0 +1,125 @@
+#include "LineProtocol.h"
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+void LineProtocol::reset()
+{
+  len_ = 0;
+  fields_ = 0;
+  valid_ = true;
+  buf_[0] = '\0';
+}
+
+LineProtocol &LineProtocol::measurement(const char *name)
+{
+  reset();
+  appendEscaped(name, ", ");
+  return *this;
+}
+
+LineProtocol &LineProtocol::tag(const char *key, const char *value)
+{
+  append(",", 1);
+  appendEscaped(key, ",= ");
+  append("=", 1);
+  appendEscaped(value, ",= ");
+  return *this;
+}
+
+LineProtocol &LineProtocol::field(const char *key, long value)
+{
+  fieldKey(key);
+  printf("%ldi", value);
+  return *this;
+}
+
+LineProtocol &LineProtocol::field(const char *key, float value, int decimals)
+{
+  // NaN and infinity are not valid field values
+  if (isnan(value) || isinf(value))
+  {
+    return *this;
+  }
+  fieldKey(key);
+  printf("%.*f", decimals, value);
+  return *this;
+}
+
+LineProtocol &LineProtocol::field(const char *key, const char *value)
+{
+  fieldKey(key);
+  append("\"", 1);
+  appendEscaped(value, "\"\\");
+  append("\"", 1);
+  return *this;
+}
+
+LineProtocol &LineProtocol::timestamp(uint64_t ns)
+{
+  printf(" %llu", (unsigned long long)ns);
+  return *this;
+}
+
+uint64_t LineProtocol::now()
+{
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  if (tv.tv_sec < 1600000000) // not synced yet
+  {
+    return 0;
+  }
+  return (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000ULL;
+}
+
+void LineProtocol::fieldKey(const char *key)
+{
+  append(fields_++ == 0 ? " " : ",", 1);
+  appendEscaped(key, ",= ");
+  append("=", 1);
+}
+
+void LineProtocol::append(const char *s, size_t n)
+{
+  if (!valid_ || len_ + n >= SIZE)
+  {
+    valid_ = false;
+    return;
+  }
+  memcpy(buf_ + len_, s, n);
+  len_ += n;
+  buf_[len_] = '\0';
+}
+
+void LineProtocol::appendEscaped(const char *s, const char *special)
+{
+  for (; *s != '\0'; s++)
+  {
+    if (strchr(special, *s) != nullptr)
+    {
+      append("\\", 1);
+    }
+    append(s, 1);
+  }
+}
+
+void LineProtocol::printf(const char *format, ...)
+{
+  if (!valid_)
+  {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buf_ + len_, SIZE - len_, format, args);
+  va_end(args);
+  if (n < 0 || len_ + n >= SIZE)
+  {
+    valid_ = false;
+    buf_[len_] = '\0';
+    return;
+  }
+  len_ += n;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/***** InfluxDB line protocol built in a fixed buffer *****/
+
+/* Point::toLineProtocol() concatenates Strings for every tag and field. This writes one
+ * line into its own buffer instead, so building a line allocates nothing. If the line
+ * does not fit it is marked invalid rather than truncated. InfluxDBClient::writeRecord()
+ * still copies the finished line into a String in its write buffer, one allocation per line.
+ */
+class LineProtocol
+{
+public:
+  static const size_t SIZE = 512;
+
+  LineProtocol() { reset(); }
+  void reset();
+
+  LineProtocol &measurement(const char *name);
+  LineProtocol &tag(const char *key, const char *value);
+  LineProtocol &field(const char *key, long value);
+  LineProtocol &field(const char *key, float value, int decimals = 2);
+  LineProtocol &field(const char *key, const char *value);
+  LineProtocol &timestamp(uint64_t ns);
+
+  bool valid() const { return valid_ && fields_ > 0; }
+  const char *c_str() const { return buf_; }
+  size_t length() const { return len_; }
+
+  // Nanoseconds since the epoch, 0 until the clock has been set by NTP
+  static uint64_t now();
+
+private:
+  char buf_[SIZE];
+  size_t len_;
+  int fields_;
+  bool valid_;
+
+  void append(const char *s, size_t n);
+  void appendEscaped(const char *s, const char *special);
+  void fieldKey(const char *key);
+  void printf(const char *format, ...);
+};
@@ -0,0 +1,176 @@
+#include "LinkSampler.h"
+#include <WiFi.h>
+#include <esp_wifi.h>
+#include "LineProtocol.h"
+
+LinkSampler::LinkSampler(uint16_t sampleRateHz, uint32_t windowMs, uint32_t pingIntervalMs)
+    : sampleRateHz_(sampleRateHz), windowMs_(windowMs), pingIntervalMs_(pingIntervalMs), windows_(nullptr),
+      dropped_(0), channel_(0), roams_(0), windowStart_(0), ping_(nullptr), gateway_(0),
+      pingReplies_(0), pingLost_(0), rttSum_(0), rttMin_(UINT32_MAX), rttMax_(0)
+{
+  memset(bssid_, 0, sizeof(bssid_));
+}
+
+bool LinkSampler::begin()
+{
+  windows_ = xQueueCreate(QUEUE_LENGTH, sizeof(LinkWindow));
+  if (windows_ == nullptr)
+  {
+    return false;
+  }
+  windowStart_ = millis();
+  // One above the loop task (priority 1) so samples stay on time while loop() waits on
+  // HTTP; each wake-up only reads the driver state and goes back to sleep
+  return xTaskCreate(task, "link", 4096, this, 2, nullptr) == pdPASS;
+}
+
+bool LinkSampler::poll(LinkWindow &window)
+{
+  return windows_ != nullptr && xQueueReceive(windows_, &window, 0) == pdTRUE;
+}
+
+void LinkSampler::task(void *arg)
+{
+  static_cast<LinkSampler *>(arg)->run();
+}
+
+void LinkSampler::run()
+{
+  const TickType_t period = pdMS_TO_TICKS(1000 / sampleRateHz_) > 0 ? pdMS_TO_TICKS(1000 / sampleRateHz_) : 1;
+  TickType_t wake = xTaskGetTickCount();
+  for (;;)
+  {
+    vTaskDelayUntil(&wake, period);
+    sample();
+    // Not pinging yet: starts as soon as the gateway is known, not only after the first window
+    if (gateway_ == 0)
+    {
+      updatePing();
+    }
+    if (millis() - windowStart_ >= windowMs_)
+    {
+      finishWindow();
+      updatePing();
+      windowStart_ = millis();
+    }
+  }
+}
+
+void LinkSampler::sample()
+{
+  wifi_ap_record_t ap;
+  if (esp_wifi_sta_get_ap_info(&ap) != ESP_OK)
+  {
+    return; // not associated
+  }
+  static const uint8_t none[6] = {};
+  if (memcmp(bssid_, ap.bssid, sizeof(bssid_)) != 0)
+  {
+    if (memcmp(bssid_, none, sizeof(bssid_)) != 0)
+    {
+      roams_++;
+    }
+    memcpy(bssid_, ap.bssid, sizeof(bssid_));
+  }
+  rssi_.add(ap.rssi);
+  channel_ = ap.primary;
+}
+
+void LinkSampler::finishWindow()
+{
+  LinkWindow w;
+  w.timestamp = LineProtocol::now();
+  w.samples = rssi_.count();
+  w.rssiMin = rssi_.min();
+  w.rssiMax = rssi_.max();
+  w.rssiMean = rssi_.mean();
+  w.rssiP10 = rssi_.percentile(10);
+  w.rssiP50 = rssi_.percentile(50);
+  w.rssiP90 = rssi_.percentile(90);
+  w.channel = channel_;
+  memcpy(w.bssid, bssid_, sizeof(bssid_));
+  w.roams = roams_;
+  portENTER_CRITICAL(&mux_);
+  w.pingReplies = pingReplies_;
+  w.pingLost = pingLost_;
+  w.rttMin = pingReplies_ > 0 ? (float)rttMin_ : NAN;
+  w.rttMean = pingReplies_ > 0 ? (float)rttSum_ / pingReplies_ : NAN;
+  w.rttMax = pingReplies_ > 0 ? (float)rttMax_ : NAN;
+  pingReplies_ = 0;
+  pingLost_ = 0;
+  rttSum_ = 0;
+  rttMin_ = UINT32_MAX;
+  rttMax_ = 0;
+  portEXIT_CRITICAL(&mux_);
+  rssi_.reset();
+  roams_ = 0;
+  if (w.samples > 0 && xQueueSend(windows_, &w, 0) != pdTRUE)
+  {
+    dropped_++;
+  }
+}
+
+/***** (re)start the ping session when the gateway changes, e.g. after a reconnect *****/
+void LinkSampler::updatePing()
+{
+  uint32_t gateway = WiFi.isConnected() ? (uint32_t)WiFi.gatewayIP() : 0;
+  if (gateway == gateway_)
+  {
+    return;
+  }
+  if (ping_ != nullptr)
+  {
+    esp_ping_stop(ping_);
+    esp_ping_delete_session(ping_);
+    ping_ = nullptr;
+  }
+  gateway_ = gateway;
+  if (gateway == 0)
+  {
+    return;
+  }
+  esp_ping_config_t config = ESP_PING_DEFAULT_CONFIG();
+  config.target_addr.type = IPADDR_TYPE_V4;
+  config.target_addr.u_addr.ip4.addr = gateway;
+  config.count = ESP_PING_COUNT_INFINITE;
+  config.interval_ms = pingIntervalMs_;
+  config.timeout_ms = pingIntervalMs_ / 2;
+  esp_ping_callbacks_t callbacks = {};
+  callbacks.cb_args = this;
+  callbacks.on_ping_success = onPingSuccess;
+  callbacks.on_ping_timeout = onPingTimeout;
+  if (esp_ping_new_session(&config, &callbacks, &ping_) != ESP_OK)
+  {
+    ping_ = nullptr;
+    gateway_ = 0; // try again after the next window
+    return;
+  }
+  esp_ping_start(ping_);
+}
+
+void LinkSampler::onPingSuccess(esp_ping_handle_t handle, void *arg)
+{
+  LinkSampler *self = static_cast<LinkSampler *>(arg);
+  uint32_t elapsed = 0;
+  esp_ping_get_profile(handle, ESP_PING_PROF_TIMEGAP, &elapsed, sizeof(elapsed));
+  portENTER_CRITICAL(&self->mux_);
+  self->pingReplies_++;
+  self->rttSum_ += elapsed;
+  if (elapsed < self->rttMin_)
+  {
+    self->rttMin_ = elapsed;
+  }
+  if (elapsed > self->rttMax_)
+  {
+    self->rttMax_ = elapsed;
+  }
+  portEXIT_CRITICAL(&self->mux_);
+}
+
+void LinkSampler::onPingTimeout(esp_ping_handle_t handle, void *arg)
+{
+  LinkSampler *self = static_cast<LinkSampler *>(arg);
+  portENTER_CRITICAL(&self->mux_);
+  self->pingLost_++;
+  portEXIT_CRITICAL(&self->mux_);
+}
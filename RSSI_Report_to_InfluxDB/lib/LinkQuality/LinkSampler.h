@@ -0,0 +1,83 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <ping/ping_sock.h>
+#include "RssiWindow.h"
+
+/***** One reduced window of link measurements *****/
+
+struct LinkWindow
+{
+  uint64_t timestamp; // ns at the end of the window, 0 if the clock was not set
+  uint16_t samples;
+  int8_t rssiMin;
+  int8_t rssiMax;
+  float rssiMean;
+  int8_t rssiP10;
+  int8_t rssiP50;
+  int8_t rssiP90;
+  uint8_t channel;
+  uint8_t bssid[6];
+  uint16_t roams;       // BSSID changes within the window
+  uint16_t pingReplies; // to the gateway
+  uint16_t pingLost;
+  // ms, NAN without replies. ESP_PING_PROF_TIMEGAP counts whole ms, so a gateway on the LAN
+  // reads 0 or 1 and the mean is only useful over many replies
+  float rttMin;
+  float rttMean;
+  float rttMax;
+};
+
+/***** Samples the link to the AP from its own task *****/
+
+/* RSSI, channel and BSSID are read from the driver at a fixed rate and reduced into one
+ * LinkWindow per window. The gateway is pinged once a second alongside. Finished windows
+ * wait in a short queue for the main loop, so sampling keeps its rate while the loop is
+ * busy with an HTTPS request.
+ */
+class LinkSampler
+{
+public:
+  static const size_t QUEUE_LENGTH = 4;
+
+  LinkSampler(uint16_t sampleRateHz = 10, uint32_t windowMs = 10000, uint32_t pingIntervalMs = 1000);
+  bool begin();
+  // Next finished window, from the main loop
+  bool poll(LinkWindow &window);
+  // Windows dropped because the main loop did not take them in time
+  uint32_t dropped() const { return dropped_; }
+
+private:
+  uint16_t sampleRateHz_;
+  uint32_t windowMs_;
+  uint32_t pingIntervalMs_;
+  QueueHandle_t windows_;
+  uint32_t dropped_;
+
+  // Sampler task only
+  RssiWindow rssi_;
+  uint8_t channel_;
+  uint8_t bssid_[6]; // all zero until associated
+  uint16_t roams_;
+  uint32_t windowStart_;
+  esp_ping_handle_t ping_;
+  uint32_t gateway_;
+
+  // Written by the ping task
+  portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+  uint16_t pingReplies_;
+  uint16_t pingLost_;
+  uint32_t rttSum_;
+  uint32_t rttMin_;
+  uint32_t rttMax_;
+
+  static void task(void *arg);
+  void run();
+  void sample();
+  void finishWindow();
+  void updatePing();
+  static void onPingSuccess(esp_ping_handle_t handle, void *arg);
+  static void onPingTimeout(esp_ping_handle_t handle, void *arg);
+};
@@ -0,0 +1,66 @@
+#include "RssiWindow.h"
+#include <string.h>
+
+void RssiWindow::reset()
+{
+  memset(histogram_, 0, sizeof(histogram_));
+  count_ = 0;
+  sum_ = 0;
+  min_ = 0;
+  max_ = -127;
+}
+
+void RssiWindow::add(int8_t rssi)
+{
+  if (rssi > 0)
+  {
+    rssi = 0;
+  }
+  if (rssi < -127)
+  {
+    rssi = -127;
+  }
+  if (count_ == UINT16_MAX)
+  {
+    return;
+  }
+  histogram_[-rssi]++;
+  count_++;
+  sum_ += rssi;
+  if (rssi < min_)
+  {
+    min_ = rssi;
+  }
+  if (rssi > max_)
+  {
+    max_ = rssi;
+  }
+}
+
+int8_t RssiWindow::percentile(uint8_t p) const
+{
+  if (count_ == 0)
+  {
+    return 0;
+  }
+  if (p > 100)
+  {
+    p = 100;
+  }
+  uint32_t rank = ((uint32_t)p * count_ + 99) / 100;
+  if (rank == 0)
+  {
+    rank = 1;
+  }
+  // Bin i holds -i dBm, walk from the weakest signal up
+  uint32_t seen = 0;
+  for (int i = BINS - 1; i >= 0; i--)
+  {
+    seen += histogram_[i];
+    if (seen >= rank)
+    {
+      return -i;
+    }
+  }
+  return max_;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <math.h>
+#include <stdint.h>
+
+/***** Min, max, mean and percentiles of RSSI samples without storing them *****/
+
+/* RSSI is an integer in dBm between -127 and 0, so a 128 bin histogram holds a window
+ * exactly. Adding is O(1), a percentile is one walk over the bins and nothing is
+ * allocated or sorted.
+ */
+class RssiWindow
+{
+public:
+  RssiWindow() { reset(); }
+  void reset();
+  void add(int8_t rssi);
+
+  uint16_t count() const { return count_; }
+  int8_t min() const { return min_; }
+  int8_t max() const { return max_; }
+  float mean() const { return count_ > 0 ? (float)sum_ / count_ : NAN; }
+  // Nearest rank, p in 0..100; 0 for an empty window
+  int8_t percentile(uint8_t p) const;
+
+private:
+  static const int BINS = 128;
+
+  uint16_t histogram_[BINS];
+  uint16_t count_;
+  int32_t sum_;
+  int8_t min_;
+  int8_t max_;
+};
@@ -3,87 +3,177 @@
 #include <WiFi.h>
 #include <ESPmDNS.h>
 #include "MyCredentials.h"
-#include <WiFiMulti.h>
+#include "ConnectivityManager.h"
 #include <InfluxDbClient.h>
 #include <InfluxDbCloud.h>
+#include "LineProtocol.h"
+#include "LinkSampler.h"
 
 #define DEVICE "ESP32"
 #define DID "rssireporter"
 #define INFLUXDB_URL "https://eu-central-1-1.aws.cloud2.influxdata.com"
 #define INFLUXDB_BUCKET "bucket"
 #define TZ_INFO "UTC3"
+// RSSI is read 10 times a second and reported as one line per 10 s window
+#define SAMPLE_RATE_HZ 10
+#define WINDOW_MS 10000
+// Passive scan of the neighbouring APs, off channel for about 1.5 s
+#define SCAN_INTERVAL (5 * 60 * 1000)
+#define SCAN_DWELL_MS 110
+#define MAX_NEIGHBORS 20
+// One request a minute. With 6 windows and on average 4 neighbour lines a minute,
+// about 12 minutes of lines are kept while InfluxDB is away, retried with backoff
+// from 5 s to 5 min
+#define BATCH_SIZE 60
+#define BUFFER_SIZE 120
+#define FLUSH_INTERVAL 60
+#define RETRY_INTERVAL 5
+#define MAX_RETRY_INTERVAL 300
 
-WiFiMulti wifiMulti;
+ConnectivityManager connectivity;
 
 InfluxDBClient client(INFLUXDB_URL, INFLUXDB_ORG, INFLUXDB_BUCKET, INFLUXDB_TOKEN, InfluxDbCloud2CACert);
 
-Point sensor("wifi_status");
+LineProtocol line;
+LinkSampler sampler(SAMPLE_RATE_HZ, WINDOW_MS);
 
-void connectWiFi();
+bool connectInfluxDB();
+void writeWindow(const LinkWindow &w);
+void scanNeighbors();
+void writeLine();
+void formatBssid(const uint8_t *bssid, char *out);
 void setupOTA();
 
 void setup()
 {
   Serial.begin(9600);
-  connectWiFi();
+  // Syncs in the background once Wi-Fi is up
+  configTzTime(TZ_INFO, "pool.ntp.org", "time.nis.gov");
+  connectivity.setService(connectInfluxDB, nullptr);
+  connectivity.onStateChange([](ConnectivityManager::State from, ConnectivityManager::State to)
+                             { Serial.printf("Connection: %s -> %s\n", ConnectivityManager::stateName(from), ConnectivityManager::stateName(to)); });
+  connectivity.begin(WIFI_SSID, WIFI_PASSWORD);
   setupOTA();
-  timeSync(TZ_INFO, "pool.ntp.org", "time.nis.gov");
-  if (client.validateConnection())
+  client.setWriteOptions(WriteOptions()
+                             .writePrecision(WritePrecision::NS)
+                             .batchSize(BATCH_SIZE)
+                             .bufferSize(BUFFER_SIZE)
+                             .flushInterval(FLUSH_INTERVAL)
+                             .retryInterval(RETRY_INTERVAL)
+                             .maxRetryInterval(MAX_RETRY_INTERVAL));
+  client.setHTTPOptions(HTTPOptions().connectionReuse(true));
+  if (!sampler.begin())
   {
-    Serial.print("Connected to InfluxDB: ");
-    Serial.println(client.getServerUrl());
+    Serial.println("Link sampler task not started");
   }
-  else
-  {
-    Serial.print("InfluxDB connection failed: ");
-    Serial.println(client.getLastErrorMessage());
-  }
-  sensor.addTag("device", DEVICE);
-  sensor.addTag("SSID", WiFi.SSID());
 }
 
 void loop()
 {
   ArduinoOTA.handle();
-  // Clear fields for reusing the point. Tags will remain the same as set above.
-  sensor.clearFields();
-
-  // Store measured value into point
-  // Report RSSI of currently connected network
-  sensor.addField("rssi", WiFi.RSSI());
+  connectivity.loop();
+  LinkWindow window;
+  while (sampler.poll(window))
+  {
+    writeWindow(window);
+  }
+  scanNeighbors();
+}
 
-  // Print what are we exactly writing
-  Serial.print("Writing: ");
-  Serial.println(sensor.toLineProtocol());
+/***** one line per window, timestamped when the window closed *****/
+void writeWindow(const LinkWindow &w)
+{
+  if (w.timestamp == 0)
+  {
+    Serial.println("Time not set yet, window skipped");
+    return;
+  }
+  char bssid[18];
+  formatBssid(w.bssid, bssid);
+  // rssi stays an integer field, as written before windows were introduced
+  line.measurement("wifi_status").tag("device", DEVICE).tag("SSID", WIFI_SSID).tag("bssid", bssid);
+  line.field("rssi", (long)lroundf(w.rssiMean)).field("rssi_min", (long)w.rssiMin).field("rssi_max", (long)w.rssiMax);
+  line.field("rssi_mean", w.rssiMean).field("rssi_p10", (long)w.rssiP10).field("rssi_p50", (long)w.rssiP50).field("rssi_p90", (long)w.rssiP90);
+  line.field("samples", (long)w.samples).field("channel", (long)w.channel).field("roams", (long)w.roams);
+  line.field("ping_replies", (long)w.pingReplies).field("ping_lost", (long)w.pingLost);
+  line.field("rtt_min", w.rttMin).field("rtt_mean", w.rttMean).field("rtt_max", w.rttMax);
+  line.timestamp(w.timestamp);
+  writeLine();
+}
 
-  // Check WiFi connection and reconnect if needed
-  if (wifiMulti.run() != WL_CONNECTED)
+/***** start a passive scan every SCAN_INTERVAL, one line per neighbouring AP when done *****/
+void scanNeighbors()
+{
+  static uint32_t lastScan = 0;
+  static bool scanning = false;
+  if (!scanning)
   {
-    Serial.println("Wifi connection lost");
+    // Only while connected, a scan would slow down connecting
+    if (connectivity.connected() && millis() - lastScan >= SCAN_INTERVAL)
+    {
+      scanning = WiFi.scanNetworks(true, false, true, SCAN_DWELL_MS) == WIFI_SCAN_RUNNING;
+      lastScan = millis();
+    }
+    return;
   }
+  int16_t found = WiFi.scanComplete();
+  if (found == WIFI_SCAN_RUNNING)
+  {
+    return;
+  }
+  scanning = false;
+  uint64_t timestamp = LineProtocol::now();
+  for (int16_t i = 0; i < found && i < MAX_NEIGHBORS && timestamp != 0; i++)
+  {
+    char bssid[18];
+    formatBssid(WiFi.BSSID(i), bssid);
+    line.measurement("wifi_neighbor").tag("device", DEVICE).tag("bssid", bssid);
+    String ssid = WiFi.SSID(i);
+    if (ssid.length() > 0)
+    {
+      line.tag("SSID", ssid.c_str());
+    }
+    line.field("rssi", (long)WiFi.RSSI(i)).field("channel", (long)WiFi.channel(i)).timestamp(timestamp);
+    writeLine();
+  }
+  WiFi.scanDelete();
+}
 
-  // Write point
-  if (!client.writePoint(sensor))
+/***** Buffered, sent once BATCH_SIZE lines or FLUSH_INTERVAL seconds are reached *****/
+void writeLine()
+{
+  if (!line.valid())
+  {
+    Serial.println("Line too long, skipped");
+    return;
+  }
+  // Print what are we exactly writing
+  Serial.print("Writing: ");
+  Serial.println(line.c_str());
+  if (!client.writeRecord(line.c_str()))
   {
     Serial.print("InfluxDB write failed: ");
     Serial.println(client.getLastErrorMessage());
   }
+}
 
-  Serial.println("Waiting 1 second");
-  delay(1000);
+void formatBssid(const uint8_t *bssid, char *out)
+{
+  snprintf(out, 18, "%02x:%02x:%02x:%02x:%02x:%02x", bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
 }
 
-/***** Connect to WiFi *****/
-void connectWiFi()
+/***** Check the server once per connection, retried with backoff; blocks loop() for up to the HTTP timeout *****/
+bool connectInfluxDB()
 {
-  WiFi.mode(WIFI_STA);
-  wifiMulti.addAP(WIFI_SSID, WIFI_PASSWORD);
-  while (wifiMulti.run() != WL_CONNECTED)
+  if (!client.validateConnection())
   {
-    delay(500);
-    if (millis() > 15000)
-      ESP.restart();
+    Serial.print("InfluxDB connection failed: ");
+    Serial.println(client.getLastErrorMessage());
+    return false;
   }
+  Serial.print("Connected to InfluxDB: ");
+  Serial.println(client.getServerUrl());
+  return true;
 }
 
 /***** Setup OTA *****/
@@ -99,7 +189,9 @@ void setupOTA()
     } else {
       type = "filesystem";
     }
-    Serial.println("Start updating " + type); });
+    Serial.println("Start updating " + type);
+    // Buffered points would be lost in the restart
+    client.flushBuffer(); });
   ArduinoOTA.onEnd([]()
                    { Serial.println("\nEnd"); });
   ArduinoOTA.onProgress([](unsigned int progress, unsigned int total)
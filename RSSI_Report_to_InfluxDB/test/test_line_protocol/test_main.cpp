@@ -0,0 +1,106 @@
+#include <unity.h>
+#include <string.h>
+#include <math.h>
+#include "LineProtocol.h"
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_measurement_and_tags_are_escaped()
+{
+  LineProtocol line;
+  line.measurement("wifi link,x").tag("ssid name", "a,b=c").field("rssi", -60L);
+  TEST_ASSERT_TRUE(line.valid());
+  TEST_ASSERT_EQUAL_STRING("wifi\\ link\\,x,ssid\\ name=a\\,b\\=c rssi=-60i", line.c_str());
+}
+
+void test_string_field_escapes_quote_and_backslash()
+{
+  LineProtocol line;
+  line.measurement("m").field("note", "say \"hi\" \\o/");
+  TEST_ASSERT_EQUAL_STRING("m note=\"say \\\"hi\\\" \\\\o/\"", line.c_str());
+}
+
+void test_fields_and_timestamp()
+{
+  LineProtocol line;
+  line.measurement("m").field("a", 1L).field("b", 1.5f, 1).field("c", 0.125f).timestamp(1700000000000000000ULL);
+  TEST_ASSERT_EQUAL_STRING("m a=1i,b=1.5,c=0.12 1700000000000000000", line.c_str());
+  TEST_ASSERT_EQUAL_INT(strlen(line.c_str()), line.length());
+}
+
+void test_nan_field_is_left_out()
+{
+  LineProtocol line;
+  line.measurement("m").field("rtt", NAN).field("inf", INFINITY);
+  TEST_ASSERT_FALSE(line.valid());
+  line.field("loss", 0L);
+  TEST_ASSERT_TRUE(line.valid());
+  TEST_ASSERT_EQUAL_STRING("m loss=0i", line.c_str());
+}
+
+void test_line_without_fields_is_invalid()
+{
+  LineProtocol line;
+  line.measurement("m").tag("t", "v");
+  TEST_ASSERT_FALSE(line.valid());
+}
+
+void test_overflow_marks_the_line_invalid()
+{
+  char value[LineProtocol::SIZE];
+  memset(value, 'x', sizeof(value) - 1);
+  value[sizeof(value) - 1] = '\0';
+  LineProtocol line;
+  line.measurement("m").field("s", value);
+  TEST_ASSERT_FALSE(line.valid());
+  TEST_ASSERT_TRUE(line.length() < LineProtocol::SIZE);
+  TEST_ASSERT_EQUAL_INT(strlen(line.c_str()), line.length());
+  // Nothing is appended once the line overflowed
+  size_t length = line.length();
+  line.field("n", 1L);
+  TEST_ASSERT_FALSE(line.valid());
+  TEST_ASSERT_EQUAL_INT(length, line.length());
+}
+
+void test_formatted_value_that_does_not_fit_is_not_cut()
+{
+  char key[LineProtocol::SIZE - 8];
+  memset(key, 'k', sizeof(key) - 1);
+  key[sizeof(key) - 1] = '\0';
+  LineProtocol line;
+  line.measurement("m");
+  size_t before = line.length();
+  line.field(key, 1234567L);
+  TEST_ASSERT_FALSE(line.valid());
+  // The key went in, the number did not, and the buffer still ends at the length
+  TEST_ASSERT_TRUE(line.length() > before);
+  TEST_ASSERT_EQUAL_INT(strlen(line.c_str()), line.length());
+}
+
+void test_reset_by_measurement()
+{
+  LineProtocol line;
+  line.measurement("a").field("x", 1L);
+  line.measurement("b").field("y", 2L);
+  TEST_ASSERT_EQUAL_STRING("b y=2i", line.c_str());
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_measurement_and_tags_are_escaped);
+  RUN_TEST(test_string_field_escapes_quote_and_backslash);
+  RUN_TEST(test_fields_and_timestamp);
+  RUN_TEST(test_nan_field_is_left_out);
+  RUN_TEST(test_line_without_fields_is_invalid);
+  RUN_TEST(test_overflow_marks_the_line_invalid);
+  RUN_TEST(test_formatted_value_that_does_not_fit_is_not_cut);
+  RUN_TEST(test_reset_by_measurement);
+  return UNITY_END();
+}
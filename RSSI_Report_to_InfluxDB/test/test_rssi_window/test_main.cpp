@@ -0,0 +1,107 @@
+#include <unity.h>
+#include <math.h>
+#include "RssiWindow.h"
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_empty_window()
+{
+  RssiWindow w;
+  TEST_ASSERT_EQUAL_INT(0, w.count());
+  TEST_ASSERT_EQUAL_INT(0, w.percentile(50));
+  TEST_ASSERT_TRUE(isnan(w.mean()));
+}
+
+void test_min_max_mean()
+{
+  RssiWindow w;
+  w.add(-70);
+  w.add(-50);
+  w.add(-60);
+  TEST_ASSERT_EQUAL_INT(3, w.count());
+  TEST_ASSERT_EQUAL_INT(-70, w.min());
+  TEST_ASSERT_EQUAL_INT(-50, w.max());
+  TEST_ASSERT_FLOAT_WITHIN(0.001, -60.0, w.mean());
+}
+
+void test_percentile_is_nearest_rank()
+{
+  // -100 .. -1 dBm, one sample each
+  RssiWindow w;
+  for (int rssi = -1; rssi >= -100; rssi--)
+  {
+    w.add(rssi);
+  }
+  TEST_ASSERT_EQUAL_INT(-100, w.percentile(0));
+  TEST_ASSERT_EQUAL_INT(-100, w.percentile(1));
+  TEST_ASSERT_EQUAL_INT(-91, w.percentile(10));
+  TEST_ASSERT_EQUAL_INT(-51, w.percentile(50));
+  TEST_ASSERT_EQUAL_INT(-11, w.percentile(90));
+  TEST_ASSERT_EQUAL_INT(-1, w.percentile(100));
+  TEST_ASSERT_EQUAL_INT(-1, w.percentile(200));
+}
+
+void test_percentile_rounds_the_rank_up()
+{
+  RssiWindow w;
+  w.add(-80);
+  w.add(-70);
+  w.add(-60);
+  // Rank ceil(p * 3 / 100)
+  TEST_ASSERT_EQUAL_INT(-80, w.percentile(33));
+  TEST_ASSERT_EQUAL_INT(-70, w.percentile(34));
+  TEST_ASSERT_EQUAL_INT(-70, w.percentile(50));
+  TEST_ASSERT_EQUAL_INT(-60, w.percentile(67));
+}
+
+void test_single_value()
+{
+  RssiWindow w;
+  for (int i = 0; i < 10; i++)
+  {
+    w.add(-42);
+  }
+  TEST_ASSERT_EQUAL_INT(-42, w.percentile(10));
+  TEST_ASSERT_EQUAL_INT(-42, w.percentile(90));
+}
+
+void test_out_of_range_is_clamped()
+{
+  RssiWindow w;
+  w.add(5);
+  w.add(-128);
+  TEST_ASSERT_EQUAL_INT(0, w.max());
+  TEST_ASSERT_EQUAL_INT(-127, w.min());
+  TEST_ASSERT_EQUAL_INT(-127, w.percentile(50));
+  TEST_ASSERT_EQUAL_INT(0, w.percentile(100));
+}
+
+void test_reset()
+{
+  RssiWindow w;
+  w.add(-30);
+  w.reset();
+  w.add(-90);
+  TEST_ASSERT_EQUAL_INT(1, w.count());
+  TEST_ASSERT_EQUAL_INT(-90, w.max());
+  TEST_ASSERT_EQUAL_INT(-90, w.percentile(50));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_window);
+  RUN_TEST(test_min_max_mean);
+  RUN_TEST(test_percentile_is_nearest_rank);
+  RUN_TEST(test_percentile_rounds_the_rank_up);
+  RUN_TEST(test_single_value);
+  RUN_TEST(test_out_of_range_is_clamped);
+  RUN_TEST(test_reset);
+  return UNITY_END();
+}
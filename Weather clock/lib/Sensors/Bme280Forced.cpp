@@ -0,0 +1,158 @@
+#include "Bme280Forced.h"
+
+namespace
+{
+  const uint8_t REG_CALIB_T_P = 0x88;
+  const uint8_t REG_CALIB_H1 = 0xA1;
+  const uint8_t REG_CHIP_ID = 0xD0;
+  const uint8_t REG_CALIB_H = 0xE1;
+  const uint8_t REG_CTRL_HUM = 0xF2;
+  const uint8_t REG_CTRL_MEAS = 0xF4;
+  const uint8_t REG_CONFIG = 0xF5;
+  const uint8_t REG_DATA = 0xF7;
+  const uint8_t CHIP_ID = 0x60;
+  const uint8_t HUM_X1 = 0x01;
+  const uint8_t MEAS_X1_FORCED = 0x25; // temperature x1, pressure x1, forced mode
+  const int32_t ADC_SKIPPED = 0x80000;
+
+  inline uint16_t le16(const uint8_t *b) { return b[0] | (b[1] << 8); }
+}
+
+Bme280Forced::Bme280Forced(uint8_t address, TwoWire &wire)
+    : address_(address), wire_(wire), valid_(false), temperature_(NAN), pressure_(NAN), humidity_(NAN)
+{
+}
+
+bool Bme280Forced::begin()
+{
+  uint8_t id = 0;
+  if (!read(REG_CHIP_ID, &id, 1) || id != CHIP_ID)
+  {
+    return false;
+  }
+  uint8_t tp[24]; // 0x88..0x9F
+  uint8_t h[7];   // 0xE1..0xE7
+  if (!read(REG_CALIB_T_P, tp, sizeof(tp)) || !read(REG_CALIB_H1, &h1_, 1) || !read(REG_CALIB_H, h, sizeof(h)))
+  {
+    return false;
+  }
+  t1_ = le16(tp);
+  t2_ = le16(tp + 2);
+  t3_ = le16(tp + 4);
+  p1_ = le16(tp + 6);
+  p2_ = le16(tp + 8);
+  p3_ = le16(tp + 10);
+  p4_ = le16(tp + 12);
+  p5_ = le16(tp + 14);
+  p6_ = le16(tp + 16);
+  p7_ = le16(tp + 18);
+  p8_ = le16(tp + 20);
+  p9_ = le16(tp + 22);
+  h2_ = le16(h);
+  h3_ = h[2];
+  h4_ = ((int8_t)h[3] * 16) | (h[4] & 0x0F);
+  h5_ = ((int8_t)h[5] * 16) | (h[4] >> 4);
+  h6_ = (int8_t)h[6];
+  // ctrl_hum only takes effect with the next write of ctrl_meas, done by start()
+  return write8(REG_CTRL_HUM, HUM_X1) && write8(REG_CONFIG, 0);
+}
+
+bool Bme280Forced::start()
+{
+  return write8(REG_CTRL_MEAS, MEAS_X1_FORCED);
+}
+
+bool Bme280Forced::fetch()
+{
+  uint8_t d[8];
+  if (!read(REG_DATA, d, sizeof(d)))
+  {
+    valid_ = false;
+    return false;
+  }
+  int32_t adcP = ((int32_t)d[0] << 12) | ((int32_t)d[1] << 4) | (d[2] >> 4);
+  int32_t adcT = ((int32_t)d[3] << 12) | ((int32_t)d[4] << 4) | (d[5] >> 4);
+  int32_t adcH = ((int32_t)d[6] << 8) | d[7];
+  // Reset value, no conversion has completed
+  if (adcT == ADC_SKIPPED)
+  {
+    valid_ = false;
+    return false;
+  }
+  int32_t tFine;
+  temperature_ = compensateTemperature(adcT, tFine) / 100.0f;
+  pressure_ = compensatePressure(adcP, tFine) / 256.0f;
+  humidity_ = compensateHumidity(adcH, tFine) / 1024.0f;
+  valid_ = true;
+  return true;
+}
+
+bool Bme280Forced::write8(uint8_t reg, uint8_t value)
+{
+  wire_.beginTransmission(address_);
+  wire_.write(reg);
+  wire_.write(value);
+  return wire_.endTransmission() == 0;
+}
+
+bool Bme280Forced::read(uint8_t reg, uint8_t *buf, size_t size)
+{
+  wire_.beginTransmission(address_);
+  wire_.write(reg);
+  if (wire_.endTransmission() != 0 || wire_.requestFrom(address_, (uint8_t)size) != size)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < size; i++)
+  {
+    buf[i] = wire_.read();
+  }
+  return true;
+}
+
+/***** compensation formulas from the BME280 datasheet, section 4.2.3 *****/
+
+// 0.01 °C
+int32_t Bme280Forced::compensateTemperature(int32_t adc, int32_t &tFine) const
+{
+  int32_t var1 = ((((adc >> 3) - ((int32_t)t1_ << 1))) * ((int32_t)t2_)) >> 11;
+  int32_t var2 = (((((adc >> 4) - ((int32_t)t1_)) * ((adc >> 4) - ((int32_t)t1_))) >> 12) * ((int32_t)t3_)) >> 14;
+  tFine = var1 + var2;
+  return (tFine * 5 + 128) >> 8;
+}
+
+// Pa in Q24.8
+uint32_t Bme280Forced::compensatePressure(int32_t adc, int32_t tFine) const
+{
+  int64_t var1 = (int64_t)tFine - 128000;
+  int64_t var2 = var1 * var1 * (int64_t)p6_;
+  var2 = var2 + ((var1 * (int64_t)p5_) << 17);
+  var2 = var2 + (((int64_t)p4_) << 35);
+  var1 = ((var1 * var1 * (int64_t)p3_) >> 8) + ((var1 * (int64_t)p2_) << 12);
+  var1 = (((((int64_t)1) << 47) + var1)) * ((int64_t)p1_) >> 33;
+  if (var1 == 0)
+  {
+    return 0;
+  }
+  int64_t p = 1048576 - adc;
+  p = (((p << 31) - var2) * 3125) / var1;
+  var1 = (((int64_t)p9_) * (p >> 13) * (p >> 13)) >> 25;
+  var2 = (((int64_t)p8_) * p) >> 19;
+  p = ((p + var1 + var2) >> 8) + (((int64_t)p7_) << 4);
+  return (uint32_t)p;
+}
+
+// %RH in Q22.10
+uint32_t Bme280Forced::compensateHumidity(int32_t adc, int32_t tFine) const
+{
+  int32_t v = tFine - ((int32_t)76800);
+  v = (((((adc << 14) - (((int32_t)h4_) << 20) - (((int32_t)h5_) * v)) + ((int32_t)16384)) >> 15) *
+       (((((((v * ((int32_t)h6_)) >> 10) * (((v * ((int32_t)h3_)) >> 11) + ((int32_t)32768))) >> 10) + ((int32_t)2097152)) *
+             ((int32_t)h2_) +
+         8192) >>
+        14));
+  v = (v - (((((v >> 15) * (v >> 15)) >> 7) * ((int32_t)h1_)) >> 4));
+  v = v < 0 ? 0 : v;
+  v = v > 419430400 ? 419430400 : v;
+  return (uint32_t)(v >> 12);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Wire.h>
+
+/***** BME280 in forced mode, split into trigger and fetch *****/
+
+/* The Adafruit driver runs the sensor in normal mode with 16x oversampling and reads
+ * temperature, pressure and humidity in separate transactions, temperature three times.
+ * Here start() writes one register to begin a single 1x conversion and fetch(), called
+ * MEASURE_MS later, reads all results in one burst and compensates them, so neither
+ * call waits for the sensor.
+ */
+class Bme280Forced
+{
+public:
+  // Maximum conversion time with 1x oversampling of all three is 9.3 ms
+  static const uint32_t MEASURE_MS = 10;
+
+  explicit Bme280Forced(uint8_t address = 0x76, TwoWire &wire = Wire);
+  // Blocking: checks the chip ID and reads the calibration, for setup()
+  bool begin();
+
+  bool start();
+  bool fetch();
+
+  bool valid() const { return valid_; }
+  float temperature() const { return temperature_; } // °C
+  float pressure() const { return pressure_; }       // Pa
+  float humidity() const { return humidity_; }       // %RH
+
+private:
+  uint8_t address_;
+  TwoWire &wire_;
+  bool valid_;
+  float temperature_;
+  float pressure_;
+  float humidity_;
+
+  uint16_t t1_;
+  int16_t t2_, t3_;
+  uint16_t p1_;
+  int16_t p2_, p3_, p4_, p5_, p6_, p7_, p8_, p9_;
+  uint8_t h1_, h3_;
+  int16_t h2_, h4_, h5_;
+  int8_t h6_;
+
+  bool write8(uint8_t reg, uint8_t value);
+  bool read(uint8_t reg, uint8_t *buf, size_t size);
+  int32_t compensateTemperature(int32_t adc, int32_t &tFine) const;
+  uint32_t compensatePressure(int32_t adc, int32_t tFine) const;
+  uint32_t compensateHumidity(int32_t adc, int32_t tFine) const;
+};
@@ -0,0 +1,113 @@
+#include "Mhz19Reader.h"
+
+namespace
+{
+  const uint8_t START = 0xFF;
+  const uint8_t SENSOR = 0x01;
+  const uint8_t CMD_CO2_UNLIMITED = 0x85; // what MHZ19::getCO2(true) sends
+  // The sensor answers 0 while warming up and garbage above its range after a reset
+  const int CO2_MAX = 10000;
+}
+
+Mhz19Reader::Mhz19Reader(Stream &serial)
+    : serial_(serial), state_(IDLE), count_(0), started_(0), valid_(false), co2_(0), errors_(0)
+{
+  memset(command_, 0, sizeof(command_));
+  command_[0] = START;
+  command_[1] = SENSOR;
+  command_[2] = CMD_CO2_UNLIMITED;
+  command_[8] = checksum(command_);
+}
+
+void Mhz19Reader::request()
+{
+  if (state_ != IDLE)
+  {
+    return;
+  }
+  // Leftovers of an earlier answer would break the framing
+  while (serial_.available() > 0)
+  {
+    serial_.read();
+  }
+  count_ = 0;
+  started_ = millis();
+  state_ = SENDING;
+}
+
+bool Mhz19Reader::poll()
+{
+  switch (state_)
+  {
+  case SENDING:
+    serial_.write(command_[count_++]);
+    if (count_ == sizeof(command_))
+    {
+      count_ = 0;
+      started_ = millis();
+      state_ = RECEIVING;
+    }
+    return false;
+
+  case RECEIVING:
+    while (serial_.available() > 0 && count_ < sizeof(response_))
+    {
+      uint8_t b = serial_.read();
+      if (count_ == 0 && b != START)
+      {
+        continue; // resynchronise on the start byte
+      }
+      response_[count_++] = b;
+    }
+    if (count_ == sizeof(response_))
+    {
+      if (response_[1] != CMD_CO2_UNLIMITED || response_[8] != checksum(response_))
+      {
+        return finish(false);
+      }
+      int co2 = (response_[4] << 8) | response_[5];
+      if (co2 <= 0 || co2 > CO2_MAX)
+      {
+        return finish(false);
+      }
+      co2_ = co2;
+      return finish(true);
+    }
+    if (millis() - started_ > TIMEOUT_MS)
+    {
+      return finish(false);
+    }
+    return false;
+
+  default:
+    return false;
+  }
+}
+
+void Mhz19Reader::cancel()
+{
+  state_ = IDLE;
+  count_ = 0;
+}
+
+bool Mhz19Reader::finish(bool ok)
+{
+  valid_ = ok;
+  if (!ok)
+  {
+    errors_++;
+  }
+  state_ = IDLE;
+  return true;
+}
+
+// 0xFF - (sum of bytes 1..7) + 1
+uint8_t Mhz19Reader::checksum(const uint8_t *packet)
+{
+  uint8_t sum = 0;
+  for (size_t i = 1; i < 8; i++)
+  {
+    sum += packet[i];
+  }
+  return 0xFF - sum + 1;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <Arduino.h>
+
+/***** MH-Z19 CO2 reading as a request and a later parse *****/
+
+/* MHZ19::getCO2() sends the command and then waits for the 9 byte answer. Here
+ * request() only arms the reader and poll(), called every few milliseconds, writes
+ * the command one byte per call (SoftwareSerial busy-waits a byte time, about 1 ms at
+ * 9600 baud) and then takes the answer as it arrives.
+ */
+class Mhz19Reader
+{
+public:
+  static const uint32_t TIMEOUT_MS = 200;
+
+  explicit Mhz19Reader(Stream &serial);
+
+  void request();
+  // Advance; true once when the reading is done, valid() tells whether it succeeded
+  bool poll();
+  // Drop a request in progress, before another user of the port takes over
+  void cancel();
+
+  bool busy() const { return state_ != IDLE; }
+  bool valid() const { return valid_; }
+  int co2() const { return co2_; } // ppm, unlimited range
+  uint32_t errors() const { return errors_; }
+
+private:
+  enum State
+  {
+    IDLE,
+    SENDING,
+    RECEIVING
+  };
+
+  Stream &serial_;
+  State state_;
+  uint8_t command_[9];
+  uint8_t response_[9];
+  size_t count_;
+  uint32_t started_;
+  bool valid_;
+  int co2_;
+  uint32_t errors_;
+
+  bool finish(bool ok);
+  static uint8_t checksum(const uint8_t *packet);
+};
@@ -0,0 +1,41 @@
+#include "TaskLatency.h"
+
+uint32_t TaskLatency::worstRun_[TaskLatency::MAX_TASKS];
+uint32_t TaskLatency::worstDelay_[TaskLatency::MAX_TASKS];
+
+TaskLatency::TaskLatency(size_t task, uint32_t startDelayMs)
+    : task_(task < MAX_TASKS ? task : MAX_TASKS - 1), start_(micros())
+{
+  if (startDelayMs > worstDelay_[task_])
+  {
+    worstDelay_[task_] = startDelayMs;
+  }
+}
+
+TaskLatency::~TaskLatency()
+{
+  uint32_t run = micros() - start_;
+  if (run > worstRun_[task_])
+  {
+    worstRun_[task_] = run;
+  }
+}
+
+size_t TaskLatency::worstTask()
+{
+  size_t worst = 0;
+  for (size_t i = 1; i < MAX_TASKS; i++)
+  {
+    if (worstRun_[i] > worstRun_[worst])
+    {
+      worst = i;
+    }
+  }
+  return worst;
+}
+
+void TaskLatency::reset()
+{
+  memset(worstRun_, 0, sizeof(worstRun_));
+  memset(worstDelay_, 0, sizeof(worstDelay_));
+}
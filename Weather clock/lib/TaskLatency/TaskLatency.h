@@ -0,0 +1,32 @@
+#pragma once
+
+#include <Arduino.h>
+
+/***** Worst case run time and start delay of cooperative tasks *****/
+
+/* Put one on the stack at the top of a task callback. It records how late the task
+ * started, as given by the scheduler, and on return how long it ran, keeping the worst
+ * of each per task until reset(). A long run delays every task behind it, so the worst
+ * run time is the bound on display jitter.
+ */
+class TaskLatency
+{
+public:
+  static const size_t MAX_TASKS = 16;
+
+  TaskLatency(size_t task, uint32_t startDelayMs);
+  ~TaskLatency();
+
+  static uint32_t worstRunMicros(size_t task) { return task < MAX_TASKS ? worstRun_[task] : 0; }
+  static uint32_t worstStartDelayMs(size_t task) { return task < MAX_TASKS ? worstDelay_[task] : 0; }
+  // Task with the longest run since reset()
+  static size_t worstTask();
+  static void reset();
+
+private:
+  size_t task_;
+  uint32_t start_;
+
+  static uint32_t worstRun_[MAX_TASKS];
+  static uint32_t worstDelay_[MAX_TASKS];
+};
@@ -11,15 +11,18 @@
 #include <ESP8266WiFi.h>
 #include <RTClib.h>
 #include <LiquidCrystal_I2C.h>
-#include <Adafruit_Sensor.h>
-#include <Adafruit_BME280.h>
+#include <Wire.h>
+#include "Bme280Forced.h"
+#define _TASK_TIMECRITICAL // start delay of each task, for TaskLatency
 #include <TaskScheduler.h>
+#include "TaskLatency.h"
 #include <NTPClient.h>
 #include <WiFiUdp.h>
 #include <TimeLib.h>
 #include <DST_RTC.h>
 #include <ArduinoJson.h>
 #include <MHZ19.h>
+#include "Mhz19Reader.h"
 #include <SoftwareSerial.h>
 #include <ESP8266mDNS.h>
 #include <WiFiUdp.h>
@@ -46,12 +49,13 @@ const byte RX_PIN = 12;       // D6 on ESP8266
 const byte TX_PIN = 15;       // D8 on ESP8266
 const unsigned int BAUDRATE = 9600;
 int CO2 = 0;
-MHZ19 myMHZ19;
+MHZ19 myMHZ19; // setup and calibration, readings go through co2Reader
 SoftwareSerial mySerial(RX_PIN, TX_PIN);
+Mhz19Reader co2Reader(mySerial);
 
 /***** Pressure and temperature on BME280 *****/
 
-Adafruit_BME280 bme;
+Bme280Forced bme(0x76); // address of sensor on i2c
 int tf = 0;
 int pf = 0;
 int hf = 0;
@@ -107,7 +111,9 @@ void myActivationCallback();
 void myTimeCheck();
 void myGetWeather();
 void myGetBME280();
+void myFetchBME280();
 void myGetCO2();
+void myPollCO2();
 void myCalibration();
 
 /***** declare helper functions *****/
@@ -132,6 +138,11 @@ Task t6(20 * TASK_MINUTE, TASK_FOREVER, &myGetWeather);
 Task t7(5 * TASK_SECOND, TASK_FOREVER, &myGetBME280);
 Task t8(20 * TASK_SECOND, TASK_FOREVER, &myGetCO2);
 Task t9(TASK_ONCE, TASK_FOREVER, &myCalibration);
+Task t10(Bme280Forced::MEASURE_MS, TASK_ONCE, &myFetchBME280);
+Task t11(5 * TASK_MILLISECOND, TASK_FOREVER, &myPollCO2);
+
+/* every task callback starts with MEASURE_TASK(n) for task tn, worst cases go to ThingSpeak status */
+#define MEASURE_TASK(n) TaskLatency taskLatency(n, t##n.getStartDelay())
 
 void setup()
 {
@@ -151,7 +162,8 @@ void setup()
 
   /***** initiate BME280 *****/
 
-  bme.begin(0x76); // address of sensor on i2c
+  Wire.begin();
+  bme.begin();
 
   /***** initiate LCD *****/
 
@@ -187,6 +199,8 @@ void setup()
   ts.addTask(t7);
   ts.addTask(t8);
   ts.addTask(t9);
+  ts.addTask(t10);
+  ts.addTask(t11);
   t0.enable();
   t1.enable();
   t2.enable();
@@ -208,27 +222,59 @@ void loop()
 /* function to calibrate MH-Z19B */
 void myCalibration()
 {
+  MEASURE_TASK(9);
+  // the library waits for its own answer on the same port
+  t11.disable();
+  co2Reader.cancel();
   myMHZ19.calibrate();
 }
 
-/* function to get data from MH-Z19B */
+/* function to request data from MH-Z19B, the answer is taken by myPollCO2 */
 void myGetCO2()
 {
-  int tempCO2 = myMHZ19.getCO2(true);
-  if (tempCO2 != 0)
+  MEASURE_TASK(8);
+  co2Reader.request();
+  t11.enable();
+}
+
+/* function to send the request and parse the answer of MH-Z19B a little at a time */
+void myPollCO2()
+{
+  MEASURE_TASK(11);
+  if (!co2Reader.poll())
   {
-    CO2 = tempCO2;
+    return;
+  }
+  t11.disable();
+  if (co2Reader.valid())
+  {
+    CO2 = co2Reader.co2();
   }
   _PP("CO2: ");
   _PL(CO2);
 }
 
-/* function to get data from BME280 */
+/* function to start a forced measurement on BME280, fetched by myFetchBME280 */
 void myGetBME280()
 {
-  tf = round(bme.readTemperature());
-  pf = round(bme.readPressure() / float(133.3));
-  hf = round(bme.readHumidity());
+  MEASURE_TASK(7);
+  if (bme.start())
+  {
+    t10.restartDelayed(Bme280Forced::MEASURE_MS);
+  }
+}
+
+/* function to get data from BME280 once the measurement is done */
+void myFetchBME280()
+{
+  MEASURE_TASK(10);
+  if (!bme.fetch())
+  {
+    return;
+  }
+  tf = round(bme.temperature());
+  pf = round(bme.pressure() / float(133.3));
+  hf = round(bme.humidity());
   _PL(tf);
   _PL(pf);
   _PL(hf);
@@ -236,6 +282,7 @@ void myGetBME280()
 /* just tiny peace of code to get current time from DS3231 */
 void myTimeCheck()
 {
+  MEASURE_TASK(0);
   mNow = rtc.now();
 }
 
@@ -265,6 +312,7 @@ void printSpace(byte count)
 /* function to print all necessary info on LCD */
 void myLCD()
 {
+  MEASURE_TASK(1);
   char daysOfTheWeek[7][4] = {"Sun",
                               "Mon",
                               "Tue",
@@ -327,6 +375,7 @@ void myLCD()
 /* function to send data to ThingSpeak */
 void myThingSpeak()
 {
+  MEASURE_TASK(3);
   const char *myWriteAPIKey = T_AUTH; // api key for ThingSpeak
   ThingSpeak.setField(1, outWind);
   ThingSpeak.setField(2, outTemp);
@@ -339,7 +388,13 @@ void myThingSpeak()
   {
     ThingSpeak.setField(8, CO2);
   }
-  ThingSpeak.setStatus(String("Last updated: ") + String(myFirst)); // Write status to a ThingSpeak Channel
+  size_t worst = TaskLatency::worstTask();
+  char latency[64];
+  snprintf(latency, sizeof(latency), ", worst task t%u %luus, LCD late %lums", (unsigned)worst,
+           (unsigned long)TaskLatency::worstRunMicros(worst), (unsigned long)TaskLatency::worstStartDelayMs(1));
+  _PL(latency);
+  TaskLatency::reset();
+  ThingSpeak.setStatus(String("Last updated: ") + String(myFirst) + String(latency)); // Write status to a ThingSpeak Channel
   int httpCode = ThingSpeak.writeFields(SECRET_CH_ID, myWriteAPIKey);
   checkResponse(httpCode);
 }
@@ -347,6 +402,7 @@ void myThingSpeak()
 /* function to get time by NTP and adjust RTC, taking DST in consideration */
 void myNTPUpdate()
 {
+  MEASURE_TASK(4);
   if (timeClient.update())
   {
     unsigned long t = timeClient.getEpochTime();
@@ -374,6 +430,7 @@ void checkResponse(int code)
 /* function to turn lcd backlight on or off by timer */
 void myLCDTimer()
 {
+  MEASURE_TASK(2);
   static bool lcdState = true;
   const byte lcdOn = 7;
   const byte lcdOff = 21;
@@ -393,6 +450,7 @@ void myLCDTimer()
 /* function to activate some tasks with delay */
 void myActivationCallback()
 {
+  MEASURE_TASK(5);
   if (t5.getRunCounter() == 25)
   {
     t3.enable();
@@ -414,6 +472,7 @@ void myActivationCallback()
 /* function to get current temperature from openweathermap */
 void myGetWeather()
 {
+  MEASURE_TASK(6);
   const String cityID = "457065"; // Ogre
   const String oWMKey = OW_KEY;   // API key for OpenWeatherMap
   const char server[] = "api.openweathermap.org";
@@ -0,0 +1,47 @@
+# Pre-build script: gzips every *.html in src/ and lib/*/ into a <name>_html.h header next to it.
+# The page is kept in flash as a PROGMEM array and served gzip compressed.
+import glob
+import gzip
+import hashlib
+import os
+import re
+
+Import("env")
+
+
+def minify(html):
+    # Indentation and line breaks only; gzip takes care of the rest
+    return re.sub(r"\n\s*", "\n", html).strip()
+
+
+def embed(source):
+    name = os.path.splitext(os.path.basename(source))[0]
+    target = os.path.join(os.path.dirname(source), name + "_html.h")
+    if os.path.exists(target) and os.path.getmtime(target) >= os.path.getmtime(source):
+        return
+
+    with open(source, encoding="utf-8") as f:
+        html = minify(f.read()).encode("utf-8")
+
+    # mtime=0: same input gives the same bytes, so the ETag only changes with the page
+    data = gzip.compress(html, compresslevel=9, mtime=0)
+    etag = hashlib.sha1(data).hexdigest()[:16]
+
+    lines = []
+    for offset in range(0, len(data), 16):
+        lines.append("\t" + ", ".join("0x%02x" % b for b in data[offset:offset + 16]) + ",")
+
+    with open(target, "w", encoding="utf-8") as f:
+        f.write("#pragma once\n\n")
+        f.write("// Generated by embed_html.py from %s, do not edit\n\n" % os.path.basename(source))
+        f.write("#include <pgmspace.h>\n\n")
+        f.write("const char %s_html_etag[] = \"\\\"%s\\\"\";\n" % (name, etag))
+        f.write("const size_t %s_html_gz_len = %d;\n" % (name, len(data)))
+        f.write("const uint8_t %s_html_gz[] PROGMEM = {\n%s\n};\n" % (name, "\n".join(lines)))
+
+    print("embed_html: %s -> %s (%d -> %d bytes)" % (source, target, len(html), len(data)))
+
+
+project_dir = env.subst("$PROJECT_DIR")
+for source in glob.glob(os.path.join(project_dir, "src", "*.html")) + glob.glob(os.path.join(project_dir, "lib", "*", "*.html")):
+    embed(source)
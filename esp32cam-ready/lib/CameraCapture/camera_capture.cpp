@@ -0,0 +1,206 @@
+#include "camera_capture.h"
+#include <esp32-hal-log.h>
+#include <esp32-hal-psram.h>
+#include <esp_camera.h>
+#include <metrics.h>
+
+camera_capture::camera_capture(OV2640 &cam, size_t slots, uint32_t idle_timeout_ms /*= 1000*/)
+	: cam_(cam), slots_(slots), latest_consumed_(false), task_(nullptr), frame_event_(nullptr),
+	  idle_timeout_ms_(idle_timeout_ms), last_request_(0), idle_(true),
+	  sequence_(0), width_(0), height_(0), dropped_(0),
+	  frame_size_(FRAMESIZE_UXGA), quality_(12), format_changed_(false)
+{
+	for (auto &s : slots_)
+		s = slot{{nullptr, 0, 0, 0, 0, 0}, 0, false};
+}
+
+bool camera_capture::begin(BaseType_t core /*= 0*/)
+{
+	log_i("Starting capture task with %u buffers", slots_.size());
+	auto sensor = esp_camera_sensor_get();
+	if (sensor)
+	{
+		frame_size_ = sensor->status.framesize;
+		quality_ = sensor->status.quality;
+	}
+
+	// Read one frame to know the dimensions before anyone asks for them
+	cam_.run();
+	width_ = cam_.getWidth();
+	height_ = cam_.getHeight();
+
+	frame_event_ = xEventGroupCreate();
+	if (frame_event_ == nullptr)
+		return false;
+
+	return xTaskCreatePinnedToCore(task, "capture", 4096, this, 1, &task_, core) == pdPASS;
+}
+
+void camera_capture::set_format(framesize_t frame_size, int quality)
+{
+	frame_size_ = frame_size;
+	quality_ = quality;
+	format_changed_ = true;
+}
+
+camera_capture::frame_ptr camera_capture::latest()
+{
+	last_request_ = millis();
+	if (idle_ && task_)
+		xTaskNotifyGive(task_);
+
+	portENTER_CRITICAL(&lock_);
+	auto frame = latest_;
+	latest_consumed_ = true;
+	portEXIT_CRITICAL(&lock_);
+	return frame;
+}
+
+camera_capture::frame_ptr camera_capture::next(uint32_t timeout_ms /*= 1000*/)
+{
+	auto current = latest();
+	auto sequence = current ? current->sequence : 0;
+	current.reset();
+
+	auto start = millis();
+	while (frame_event_)
+	{
+		// Cleared before looking, so a frame stored in between still ends the wait
+		xEventGroupClearBits(frame_event_, frame_bit);
+		auto frame = latest();
+		if (frame && frame->sequence != sequence)
+			return frame;
+
+		frame.reset();
+		auto elapsed = millis() - start;
+		if (elapsed >= timeout_ms)
+			break;
+
+		xEventGroupWaitBits(frame_event_, frame_bit, pdFALSE, pdTRUE, pdMS_TO_TICKS(timeout_ms - elapsed));
+	}
+
+	log_w("No new frame within %lu ms", timeout_ms);
+	return latest();
+}
+
+void camera_capture::task(void *parameter)
+{
+	static_cast<camera_capture *>(parameter)->capture_loop();
+}
+
+void camera_capture::capture_loop()
+{
+	auto stalled = false;
+	while (true)
+	{
+		// Stop reading the sensor when nobody asked for a frame for a while
+		if (millis() - last_request_ > idle_timeout_ms_)
+		{
+			log_d("No consumers, capture idle");
+			idle_ = true;
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			idle_ = false;
+		}
+
+		auto s = free_slot();
+		if (s == nullptr)
+		{
+			// All buffers held by consumers: count the missed frame once per stall
+			if (!stalled)
+			{
+				++dropped_;
+				metrics.frames_dropped.inc();
+			}
+			stalled = true;
+			vTaskDelay(1);
+			continue;
+		}
+
+		stalled = false;
+
+		if (format_changed_)
+			apply_format();
+
+		auto start = micros();
+		cam_.run();
+		auto size = cam_.getSize();
+		if (size > s->capacity)
+		{
+			free(s->f.data);
+			s->f.data = static_cast<uint8_t *>(psramFound() ? ps_malloc(size) : malloc(size));
+			s->capacity = s->f.data ? size : 0;
+			if (s->f.data == nullptr)
+			{
+				log_e("Unable to allocate %u bytes for frame buffer", size);
+				release(s);
+				vTaskDelay(1);
+				continue;
+			}
+		}
+
+		memcpy(s->f.data, cam_.getfb(), size);
+		s->f.size = size;
+		s->f.width = width_ = cam_.getWidth();
+		s->f.height = height_ = cam_.getHeight();
+		s->f.timestamp = millis();
+		s->f.sequence = ++sequence_;
+		metrics.capture_time.observe(micros() - start);
+		metrics.frames_captured.inc();
+
+		auto captured = frame_ptr(&s->f, [this, s](const frame *)
+								  { release(s); });
+		portENTER_CRITICAL(&lock_);
+		latest_.swap(captured);
+		auto consumed = latest_consumed_;
+		latest_consumed_ = false;
+		portEXIT_CRITICAL(&lock_);
+		// Wakes every task waiting in next()
+		xEventGroupSetBits(frame_event_, frame_bit);
+
+		// Frame was never taken before being replaced
+		if (captured && !consumed)
+		{
+			++dropped_;
+			metrics.frames_dropped.inc();
+		}
+		// Release the previous frame outside the lock, the deleter takes it
+		captured.reset();
+	}
+}
+
+camera_capture::slot *camera_capture::free_slot()
+{
+	slot *found = nullptr;
+	portENTER_CRITICAL(&lock_);
+	for (auto &s : slots_)
+		if (!s.in_use)
+		{
+			s.in_use = true;
+			found = &s;
+			break;
+		}
+	portEXIT_CRITICAL(&lock_);
+	return found;
+}
+
+void camera_capture::release(slot *s)
+{
+	portENTER_CRITICAL(&lock_);
+	s->in_use = false;
+	portEXIT_CRITICAL(&lock_);
+}
+
+void camera_capture::apply_format()
+{
+	format_changed_ = false;
+	auto sensor = esp_camera_sensor_get();
+	if (sensor == nullptr)
+		return;
+
+	log_i("Setting frame size %d, quality %d", frame_size_, quality_);
+	if (sensor->status.framesize != frame_size_ && sensor->set_framesize(sensor, frame_size_) != 0)
+		log_e("Setting frame size %d failed", frame_size_);
+
+	if (sensor->status.quality != quality_ && sensor->set_quality(sensor, quality_) != 0)
+		log_e("Setting quality %d failed", quality_);
+}
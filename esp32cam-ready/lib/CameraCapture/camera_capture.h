@@ -0,0 +1,92 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/event_groups.h>
+#include <OV2640.h>
+
+// Captures frames on a separate task into a small ring of PSRAM buffers.
+// Every consumer that holds a frame_ptr keeps its slot out of the ring, so the ring needs
+// one slot being filled, one for the latest frame and one per consumer that can hold a frame
+// at the same time. With fewer the task waits for a free slot and every consumer stalls.
+// Buffers are allocated when a slot is first used, so spare slots cost no PSRAM
+class camera_capture
+{
+public:
+	struct frame
+	{
+		uint8_t *data;
+		size_t size;
+		uint16_t width;
+		uint16_t height;
+		// millis() when the frame was captured
+		uint32_t timestamp;
+		uint32_t sequence;
+	};
+
+	// Refcounted handle on a frame in the ring. The buffer is reused when the last handle is released
+	typedef std::shared_ptr<const frame> frame_ptr;
+
+private:
+	struct slot
+	{
+		frame f;
+		size_t capacity;
+		bool in_use;
+	};
+
+	OV2640 &cam_;
+	std::vector<slot> slots_;
+	frame_ptr latest_;
+	// Set when a consumer has taken the latest frame
+	bool latest_consumed_;
+	portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+	TaskHandle_t task_;
+	// Bit set by the task after each new frame, cleared by next() before it looks
+	EventGroupHandle_t frame_event_;
+	static const EventBits_t frame_bit = BIT0;
+
+	uint32_t idle_timeout_ms_;
+	volatile uint32_t last_request_;
+	volatile bool idle_;
+
+	uint32_t sequence_;
+	volatile uint16_t width_;
+	volatile uint16_t height_;
+	volatile uint32_t dropped_;
+
+	// Sensor format requested by set_format, applied by the task between frames
+	volatile framesize_t frame_size_;
+	volatile int quality_;
+	volatile bool format_changed_;
+
+	static void task(void *parameter);
+	void capture_loop();
+	slot *free_slot();
+	void release(slot *s);
+	void apply_format();
+
+public:
+	camera_capture(OV2640 &cam, size_t slots, uint32_t idle_timeout_ms = 1000);
+
+	// Start the capture task on the core not running the Arduino loop
+	bool begin(BaseType_t core = 0);
+
+	// Newest complete frame without copying it, or nullptr if none yet. Wakes the task if idle
+	frame_ptr latest();
+	// Block until a frame captured after this call arrives, the newest frame on timeout
+	frame_ptr next(uint32_t timeout_ms = 1000);
+
+	// Change resolution and JPEG quality (0-63, lower is better) without restarting the camera.
+	// The frame size cannot be larger than the one the camera was initialized with
+	void set_format(framesize_t frame_size, int quality);
+	framesize_t frame_size() const { return frame_size_; }
+	int quality() const { return quality_; }
+
+	uint16_t width() const { return width_; }
+	uint16_t height() const { return height_; }
+	// Frames overwritten before any consumer took them, or not captured because all buffers were in use
+	uint32_t dropped() const { return dropped_; }
+};
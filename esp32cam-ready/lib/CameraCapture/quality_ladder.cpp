@@ -0,0 +1,107 @@
+#include "quality_ladder.h"
+#include <algorithm>
+#include <esp32-hal-log.h>
+
+// Best first
+static const quality_ladder::level levels[] = {
+	{FRAMESIZE_UXGA, 10},
+	{FRAMESIZE_SXGA, 12},
+	{FRAMESIZE_XGA, 12},
+	{FRAMESIZE_SVGA, 12},
+	{FRAMESIZE_VGA, 15},
+	{FRAMESIZE_CIF, 15},
+	{FRAMESIZE_QVGA, 20},
+};
+static const size_t level_count = sizeof(levels) / sizeof(levels[0]);
+
+// Minimum time between steps down, and time without congestion before stepping one level up
+static const uint32_t step_down_msec = 3000;
+static const uint32_t step_up_msec = 10000;
+
+static const struct
+{
+	const char *name;
+	framesize_t frame_size;
+} frame_sizes[] = {
+	{"qqvga", FRAMESIZE_QQVGA},
+	{"qvga", FRAMESIZE_QVGA},
+	{"cif", FRAMESIZE_CIF},
+	{"vga", FRAMESIZE_VGA},
+	{"svga", FRAMESIZE_SVGA},
+	{"xga", FRAMESIZE_XGA},
+	{"sxga", FRAMESIZE_SXGA},
+	{"uxga", FRAMESIZE_UXGA},
+};
+
+quality_ladder::quality_ladder(camera_capture &capture)
+	: capture_(capture), level_(0), automatic_(true), last_change_(0)
+{
+}
+
+void quality_ladder::set(framesize_t frame_size, int quality, bool lock_frame_size)
+{
+	automatic_ = false;
+	if (lock_frame_size && frame_size != capture_.frame_size())
+	{
+		log_w("Frame size locked by active RTSP sessions");
+		frame_size = capture_.frame_size();
+	}
+
+	capture_.set_format(frame_size, quality);
+}
+
+void quality_ladder::set_automatic()
+{
+	automatic_ = true;
+	last_change_ = millis();
+}
+
+void quality_ladder::update(size_t clients, bool congested, bool lock_frame_size)
+{
+	if (!automatic_)
+		return;
+
+	// Best level allowed for the number of clients
+	size_t best = clients <= 1 ? 0 : clients <= 3 ? 2 : 4;
+
+	auto now = millis();
+	auto level = level_;
+	if (congested)
+	{
+		if (now - last_change_ > step_down_msec)
+			level = std::min(level_ + 1, level_count - 1);
+	}
+	else if (now - last_change_ > step_up_msec && level_ > 0)
+		level = level_ - 1;
+
+	level = std::max(level, best);
+	if (level != level_)
+	{
+		log_i("Quality level %u -> %u (%u clients%s)", level_, level, clients, congested ? ", congested" : "");
+		level_ = level;
+		last_change_ = now;
+	}
+
+	apply(lock_frame_size);
+}
+
+void quality_ladder::apply(bool lock_frame_size)
+{
+	const auto &l = levels[level_];
+	// RTP sessions keep the dimensions they were set up with, so only change the quality then
+	auto frame_size = lock_frame_size ? capture_.frame_size() : l.frame_size;
+	if (frame_size != capture_.frame_size() || l.quality != capture_.quality())
+		capture_.set_format(frame_size, l.quality);
+}
+
+bool quality_ladder::parse_frame_size(const String &name, framesize_t &frame_size)
+{
+	for (const auto &f : frame_sizes)
+		if (name.equalsIgnoreCase(f.name))
+		{
+			frame_size = f.frame_size;
+			return true;
+		}
+
+	return false;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <WString.h>
+#include "camera_capture.h"
+
+// Steps frame size and JPEG quality down when clients cannot keep up and back up when they can
+class quality_ladder
+{
+public:
+	struct level
+	{
+		framesize_t frame_size;
+		int quality;
+	};
+
+private:
+	camera_capture &capture_;
+	size_t level_;
+	bool automatic_;
+	uint32_t last_change_;
+
+	void apply(bool lock_frame_size);
+
+public:
+	quality_ladder(camera_capture &capture);
+
+	// Fixed format, e.g. from the query parameters. Disables automatic switching
+	void set(framesize_t frame_size, int quality, bool lock_frame_size);
+	void set_automatic();
+	bool automatic() const { return automatic_; }
+
+	// Called periodically. Frame size is kept when lock_frame_size is set, only the quality moves
+	void update(size_t clients, bool congested, bool lock_frame_size);
+
+	static bool parse_frame_size(const String &name, framesize_t &frame_size);
+};
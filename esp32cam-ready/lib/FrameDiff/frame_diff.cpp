@@ -0,0 +1,13 @@
+#include "frame_diff.h"
+
+uint32_t sum_abs_diff(const uint8_t *__restrict a, const uint8_t *__restrict b, size_t size)
+{
+	uint32_t sum = 0;
+	for (size_t i = 0; i < size; ++i)
+	{
+		int diff = a[i] - b[i];
+		sum += diff < 0 ? -diff : diff;
+	}
+
+	return sum;
+}
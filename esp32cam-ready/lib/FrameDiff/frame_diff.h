@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sum of absolute differences of two byte arrays. Plain loop without branches so the compiler can vectorize it
+uint32_t sum_abs_diff(const uint8_t *__restrict a, const uint8_t *__restrict b, size_t size);
@@ -0,0 +1,116 @@
+#include "metrics.h"
+#include <Esp.h>
+
+camera_metrics metrics;
+
+const uint32_t histogram::bounds[histogram::bucket_count - 1] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000};
+
+histogram::histogram()
+	: sum_us_(0), count_(0)
+{
+	for (auto &bucket : buckets_)
+		bucket.store(0, std::memory_order_relaxed);
+}
+
+void histogram::observe(uint32_t usec)
+{
+	size_t index = 0;
+	while (index < bucket_count - 1 && usec > bounds[index])
+		++index;
+
+	buckets_[index].fetch_add(1, std::memory_order_relaxed);
+	sum_us_.fetch_add(usec, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void histogram::write(String &out, const char *name, const char *help) const
+{
+	write_header(out, name, help, "histogram");
+
+	// Buckets are cumulative. Room for the longest bucket label, a 10 digit count and the newline
+	char value[48];
+	uint32_t cumulative = 0;
+	for (size_t index = 0; index < bucket_count; ++index)
+	{
+		cumulative += buckets_[index].load(std::memory_order_relaxed);
+		out += name;
+		if (index < bucket_count - 1)
+			snprintf(value, sizeof(value), "_bucket{le=\"%g\"} %u\n", bounds[index] / 1e6, cumulative);
+		else
+			snprintf(value, sizeof(value), "_bucket{le=\"+Inf\"} %u\n", cumulative);
+		out += value;
+	}
+
+	out += name;
+	snprintf(value, sizeof(value), "_sum %.6f\n", (double)sum_us_.load(std::memory_order_relaxed) / 1e6);
+	out += value;
+	out += name;
+	snprintf(value, sizeof(value), "_count %u\n", count_.load(std::memory_order_relaxed));
+	out += value;
+}
+
+// Names and help texts are appended as they are, only numbers go through a fixed buffer, so no line is cut
+void write_header(String &out, const char *name, const char *help, const char *type)
+{
+	out += "# HELP ";
+	out += name;
+	out += ' ';
+	out += help;
+	out += "\n# TYPE ";
+	out += name;
+	out += ' ';
+	out += type;
+	out += '\n';
+}
+
+static void write_sample(String &out, const char *name, uint32_t value)
+{
+	char text[16];
+	snprintf(text, sizeof(text), " %u\n", value);
+	out += name;
+	out += text;
+}
+
+void write_counter(String &out, const char *name, const char *help, uint32_t value)
+{
+	write_header(out, name, help, "counter");
+	write_sample(out, name, value);
+}
+
+void write_gauge(String &out, const char *name, const char *help, uint32_t value)
+{
+	write_header(out, name, help, "gauge");
+	write_sample(out, name, value);
+}
+
+void camera_metrics::write(String &out) const
+{
+	write_counter(out, "esp32cam_frames_captured_total", "Frames read from the sensor", frames_captured.value());
+	write_counter(out, "esp32cam_frames_dropped_total", "Captured frames no consumer took", frames_dropped.value());
+	capture_time.write(out, "esp32cam_capture_seconds", "Time to read and buffer a frame");
+
+	write_counter(out, "esp32cam_rtsp_frames_sent_total", "Frames sent to RTSP clients", rtsp_frames_sent.value());
+	write_counter(out, "esp32cam_rtsp_frames_dropped_total", "Frames skipped for congested RTSP clients", rtsp_frames_dropped.value());
+	write_counter(out, "esp32cam_rtsp_send_stalls_total", "RTSP frame writes slower than half the frame interval", rtsp_send_stalls.value());
+	write_counter(out, "esp32cam_rtsp_bytes_sent_total", "JPEG bytes sent to RTSP clients", rtsp_bytes_sent.value());
+	rtsp_send_time.write(out, "esp32cam_rtsp_send_seconds", "Time to send a frame to an RTSP client");
+
+	write_counter(out, "esp32cam_mjpeg_frames_sent_total", "Frames sent to MJPEG stream subscribers", mjpeg_frames_sent.value());
+	write_counter(out, "esp32cam_mjpeg_bytes_sent_total", "Bytes sent to MJPEG stream subscribers", mjpeg_bytes_sent.value());
+
+	write_counter(out, "esp32cam_recorder_frames_total", "Frames written to the SD card", recorder_frames.value());
+	write_counter(out, "esp32cam_recorder_frames_dropped_total", "Recording intervals missed because the card was busy", recorder_frames_dropped.value());
+	write_counter(out, "esp32cam_recorder_bytes_total", "Bytes written to the SD card", recorder_bytes.value());
+	recorder_write_time.write(out, "esp32cam_recorder_write_seconds", "Time to write a block to the SD card");
+
+	write_counter(out, "esp32cam_snapshot_hits_total", "Snapshot requests served from the cache", snapshot_hits.value());
+	write_counter(out, "esp32cam_snapshot_misses_total", "Snapshot requests that needed a new frame", snapshot_misses.value());
+
+	loop_time.write(out, "esp32cam_loop_seconds", "Duration of a main loop iteration");
+
+	write_gauge(out, "esp32cam_heap_free_bytes", "Free internal heap", ESP.getFreeHeap());
+	write_gauge(out, "esp32cam_heap_min_free_bytes", "Low-water mark of the free internal heap", ESP.getMinFreeHeap());
+	write_gauge(out, "esp32cam_psram_free_bytes", "Free PSRAM", ESP.getFreePsram());
+	write_gauge(out, "esp32cam_psram_min_free_bytes", "Low-water mark of the free PSRAM", ESP.getMinFreePsram());
+}
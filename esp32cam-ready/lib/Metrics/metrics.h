@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <WString.h>
+
+// Cheap enough for the frame path: one relaxed atomic add. 32 bits, so it wraps like a Prometheus counter reset
+class counter
+{
+private:
+	std::atomic<uint32_t> value_;
+
+public:
+	counter() : value_(0) {}
+	void inc(uint32_t n = 1) { value_.fetch_add(n, std::memory_order_relaxed); }
+	uint32_t value() const { return value_.load(std::memory_order_relaxed); }
+};
+
+// Latency histogram with fixed buckets from 100 us to 1 s
+class histogram
+{
+public:
+	static const size_t bucket_count = 13;
+	// Upper bounds in microseconds, the last bucket is +Inf
+	static const uint32_t bounds[bucket_count - 1];
+
+private:
+	std::atomic<uint32_t> buckets_[bucket_count];
+	// 64 bits, 32 would wrap after 71 minutes of a busy loop. Not lock-free on the ESP32, taken once per observation
+	std::atomic<uint64_t> sum_us_;
+	std::atomic<uint32_t> count_;
+
+public:
+	histogram();
+	void observe(uint32_t usec);
+	void write(String &out, const char *name, const char *help) const;
+};
+
+// Instrumentation for the capture path, the RTSP and MJPEG streams and the main loop
+struct camera_metrics
+{
+	counter frames_captured;
+	counter frames_dropped;
+	histogram capture_time;
+
+	counter rtsp_frames_sent;
+	counter rtsp_frames_dropped;
+	counter rtsp_send_stalls;
+	counter rtsp_bytes_sent;
+	histogram rtsp_send_time;
+
+	counter mjpeg_frames_sent;
+	counter mjpeg_bytes_sent;
+
+	counter recorder_frames;
+	counter recorder_frames_dropped;
+	counter recorder_bytes;
+	histogram recorder_write_time;
+
+	counter snapshot_hits;
+	counter snapshot_misses;
+
+	histogram loop_time;
+
+	// Prometheus text exposition format, version 0.0.4
+	void write(String &out) const;
+};
+
+extern camera_metrics metrics;
+
+void write_header(String &out, const char *name, const char *help, const char *type);
+void write_counter(String &out, const char *name, const char *help, uint32_t value);
+void write_gauge(String &out, const char *name, const char *help, uint32_t value);
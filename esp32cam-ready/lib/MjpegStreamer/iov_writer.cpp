@@ -0,0 +1,81 @@
+#include "iov_writer.h"
+#include <lwip/sockets.h>
+
+// lwIP does not accept more than its send buffer per call anyway
+#ifdef TCP_SND_BUF
+static const size_t send_window = TCP_SND_BUF;
+#else
+static const size_t send_window = 5744;
+#endif
+
+iov_writer::iov_writer()
+{
+	reset();
+}
+
+void iov_writer::reset()
+{
+	count_ = 0;
+	total_ = 0;
+	offset_ = 0;
+}
+
+bool iov_writer::add(const void *data, size_t size)
+{
+	if (count_ == max_segments)
+		return false;
+
+	segments_[count_++] = {static_cast<const uint8_t *>(data), size};
+	total_ += size;
+	return true;
+}
+
+bool iov_writer::send(int fd)
+{
+	if (done())
+		return true;
+
+	// Gather the unsent parts of the segments, up to one send window
+	iovec iov[max_segments];
+	size_t iov_count = 0;
+	size_t window = send_window;
+	size_t position = 0;
+	for (size_t index = 0; index < count_ && window > 0; position += segments_[index++].size)
+	{
+		const auto &s = segments_[index];
+		if (offset_ >= position + s.size)
+			continue;
+
+		auto skip = offset_ > position ? offset_ - position : 0;
+		auto size = s.size - skip < window ? s.size - skip : window;
+		iov[iov_count++] = {const_cast<uint8_t *>(s.data + skip), size};
+		window -= size;
+	}
+
+	msghdr message = {};
+	message.msg_iov = iov;
+	message.msg_iovlen = iov_count;
+	auto sent = sendmsg(fd, &message, MSG_DONTWAIT);
+	if (sent < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK;
+
+	offset_ += sent;
+	return true;
+}
+
+bool iov_writer::send_all(int fd, uint32_t timeout_ms /*= 5000*/)
+{
+	while (!done())
+	{
+		fd_set write_fds;
+		FD_ZERO(&write_fds);
+		FD_SET(fd, &write_fds);
+		timeval timeout;
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_usec = timeout_ms % 1000 * 1000;
+		if (select(fd + 1, nullptr, &write_fds, nullptr, &timeout) <= 0 || !send(fd))
+			return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sends a few buffers (e.g. part header, frame and trailer) with scatter/gather writes straight
+// from where they are, at most one lwIP send window per call and without copying them
+class iov_writer
+{
+private:
+	static const size_t max_segments = 4;
+
+	struct segment
+	{
+		const uint8_t *data;
+		size_t size;
+	};
+
+	segment segments_[max_segments];
+	size_t count_;
+	size_t total_;
+	size_t offset_;
+
+public:
+	iov_writer();
+
+	void reset();
+	// The buffer must stay valid until done()
+	bool add(const void *data, size_t size);
+
+	size_t total() const { return total_; }
+	size_t sent() const { return offset_; }
+	bool done() const { return offset_ == total_; }
+
+	// Write what the socket accepts without blocking. Returns false on a socket error
+	bool send(int fd);
+	// Write everything, waiting for the socket to drain. Returns false on error or timeout
+	bool send_all(int fd, uint32_t timeout_ms = 5000);
+};
@@ -0,0 +1,105 @@
+#include "mjpeg_streamer.h"
+#include <algorithm>
+#include <esp32-hal-log.h>
+#include <metrics.h>
+
+static const char stream_header[] = "HTTP/1.1 200 OK\r\n"
+									"Content-Type: multipart/x-mixed-replace; boundary=frame\r\n\r\n";
+static const char part_trailer[] = "\r\n";
+
+mjpeg_streamer::subscriber::subscriber(const WiFiClient &client)
+	: wifi_client(client), started(millis())
+{
+}
+
+bool mjpeg_streamer::subscriber::idle() const
+{
+	return writer.done();
+}
+
+void mjpeg_streamer::subscriber::start(const camera_capture::frame_ptr &next_frame)
+{
+	frame = next_frame;
+	auto part_header_size = snprintf(part_header, sizeof(part_header), "--frame\r\n"
+																	   "Content-Type: image/jpeg\r\n"
+																	   "Content-Length: %u\r\n\r\n",
+									 frame->size);
+	writer.reset();
+	writer.add(part_header, part_header_size);
+	writer.add(frame->data, frame->size);
+	writer.add(part_trailer, sizeof(part_trailer) - 1);
+	started = millis();
+}
+
+// Write as much of the current part as the socket accepts without blocking. Returns false on error
+bool mjpeg_streamer::subscriber::send()
+{
+	if (writer.done())
+		return true;
+
+	auto start = writer.sent();
+	while (!writer.done())
+	{
+		auto sent = writer.sent();
+		if (!writer.send(wifi_client.fd()))
+			return false;
+
+		// Send buffer full
+		if (writer.sent() == sent)
+			break;
+	}
+
+	metrics.mjpeg_bytes_sent.inc(writer.sent() - start);
+	if (writer.done() && frame)
+		metrics.mjpeg_frames_sent.inc();
+
+	return true;
+}
+
+mjpeg_streamer::mjpeg_streamer(camera_capture &capture)
+	: capture_(capture), msec_per_frame_(0)
+{
+}
+
+bool mjpeg_streamer::add(const WiFiClient &client)
+{
+	if (subscribers_.size() >= max_subscribers)
+		return false;
+
+	log_i("Adding mjpeg subscriber");
+	auto new_subscriber = std::unique_ptr<subscriber>(new subscriber(client));
+	new_subscriber->writer.add(stream_header, sizeof(stream_header) - 1);
+	subscribers_.push_back(std::move(new_subscriber));
+	return true;
+}
+
+bool mjpeg_streamer::congested() const
+{
+	auto now = millis();
+	return std::any_of(subscribers_.begin(), subscribers_.end(),
+					   [now](std::unique_ptr<subscriber> const &s)
+					   { return !s->idle() && now - s->started > 1000; });
+}
+
+void mjpeg_streamer::doLoop()
+{
+	// Check if any subscriber. If none: nothing to do
+	if (subscribers_.empty())
+		return;
+
+	// Subscribers that finished their frame continue with the newest one; slow ones skip frames
+	auto frame = capture_.latest();
+	auto now = millis();
+	for (const auto &s : subscribers_)
+	{
+		if (s->idle() && frame && (!s->frame || (s->frame->sequence != frame->sequence && now - s->started >= msec_per_frame_)))
+			s->start(frame);
+
+		if (!s->send())
+			s->wifi_client.stop();
+	}
+
+	subscribers_.remove_if(
+		[](std::unique_ptr<subscriber> const &s)
+		{ return !s->wifi_client.connected(); });
+}
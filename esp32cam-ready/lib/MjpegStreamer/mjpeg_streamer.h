@@ -0,0 +1,47 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <WiFiClient.h>
+#include <camera_capture.h>
+#include "iov_writer.h"
+
+class mjpeg_streamer
+{
+private:
+	struct subscriber
+	{
+		WiFiClient wifi_client;
+		// Frame being sent and the part header written before it
+		camera_capture::frame_ptr frame;
+		char part_header[80];
+		// Current part (header + frame + trailer) still to send
+		iov_writer writer;
+		// millis() when the current part was started
+		uint32_t started;
+		subscriber(const WiFiClient &client);
+		bool idle() const;
+		void start(const camera_capture::frame_ptr &next_frame);
+		bool send();
+	};
+
+	camera_capture &capture_;
+	std::list<std::unique_ptr<subscriber>> subscribers_;
+	// Minimum time between the start of two frames for a subscriber, 0 sends every frame
+	uint32_t msec_per_frame_;
+
+public:
+	// Each subscriber can hold a frame of the capture ring, see camera_capture
+	static const size_t max_subscribers = 4;
+
+	mjpeg_streamer(camera_capture &capture);
+
+	// False if all subscriber places are taken
+	bool add(const WiFiClient &client);
+	size_t subscribers() const { return subscribers_.size(); }
+	void set_frame_interval(uint32_t msec_per_frame) { msec_per_frame_ = msec_per_frame; }
+	// True if a subscriber needs more than a second for a frame
+	bool congested() const;
+
+	void doLoop();
+};
@@ -0,0 +1,147 @@
+#include "motion_detector.h"
+#include <algorithm>
+#include <string.h>
+#include <esp32-hal-log.h>
+#include <esp_jpg_decode.h>
+
+motion_detector::motion_detector(camera_capture &capture, uint32_t interval_ms /*= 200*/, uint8_t threshold /*= 6*/, uint32_t hold_ms /*= 5000*/)
+	: capture_(capture), task_(nullptr), enabled_(false), interval_ms_(interval_ms), threshold_(threshold), hold_ms_(hold_ms),
+	  scaled_width_(0), scaled_height_(0), reference_valid_(false), reference_width_(0),
+	  score_(0), motion_(false), last_motion_(0), events_(0)
+{
+}
+
+bool motion_detector::begin(BaseType_t core /*= 0*/)
+{
+	log_i("Starting motion detection task, %u ms interval", interval_ms_);
+	// Below the capture task, decoding must not delay frames
+	return xTaskCreatePinnedToCore(task, "motion", 4096, this, 0, &task_, core) == pdPASS;
+}
+
+void motion_detector::set_enabled(bool enabled)
+{
+	log_i("Motion detection %s", enabled ? "enabled" : "disabled");
+	enabled_ = enabled;
+	if (!enabled)
+		motion_ = false;
+}
+
+void motion_detector::task(void *parameter)
+{
+	static_cast<motion_detector *>(parameter)->detect_loop();
+}
+
+void motion_detector::detect_loop()
+{
+	uint32_t last_sequence = 0;
+	while (true)
+	{
+		vTaskDelay(pdMS_TO_TICKS(interval_ms_));
+		if (!enabled_)
+		{
+			reference_valid_ = false;
+			continue;
+		}
+
+		// Holding the frame keeps its buffer out of the ring while decoding
+		auto frame = capture_.latest();
+		if (!frame || frame->sequence == last_sequence)
+			continue;
+
+		last_sequence = frame->sequence;
+		auto start = millis();
+		if (!sample(*frame))
+			continue;
+
+		frame.reset();
+		log_v("Motion sample in %lu ms", millis() - start);
+
+		auto now = millis();
+		if (score_ >= threshold_)
+		{
+			if (!motion_)
+			{
+				log_i("Motion detected, score %u", score_);
+				++events_;
+			}
+
+			last_motion_ = now;
+			motion_ = true;
+		}
+		else if (motion_ && now - last_motion_ >= hold_ms_)
+		{
+			log_i("Motion ended");
+			motion_ = false;
+		}
+	}
+}
+
+// Decode at 1/8 scale into the cell grid and compare it with the previous sample. Returns false if there is no score
+bool motion_detector::sample(const camera_capture::frame &frame)
+{
+	memset(sums_, 0, sizeof(sums_));
+	memset(counts_, 0, sizeof(counts_));
+	decode_context context = {this, &frame};
+	if (esp_jpg_decode(frame.size, JPG_SCALE_8X, read_jpeg, write_pixels, &context) != ESP_OK)
+	{
+		log_w("Decoding frame %u failed", frame.sequence);
+		return false;
+	}
+
+	for (size_t i = 0; i < grid_size; ++i)
+		current_[i] = counts_[i] ? sums_[i] / counts_[i] : 0;
+
+	// The first sample and a resolution change only set the reference
+	auto valid = reference_valid_ && reference_width_ == frame.width;
+	if (valid)
+		score_ = sum_abs_diff(current_, reference_, grid_size) / grid_size;
+
+	memcpy(reference_, current_, sizeof(reference_));
+	reference_valid_ = true;
+	reference_width_ = frame.width;
+	return valid;
+}
+
+size_t motion_detector::read_jpeg(void *arg, size_t index, uint8_t *buffer, size_t length)
+{
+	auto frame = static_cast<decode_context *>(arg)->frame;
+	if (index >= frame->size)
+		return 0;
+
+	length = std::min(length, frame->size - index);
+	// The decoder skips data by reading into nullptr
+	if (buffer)
+		memcpy(buffer, frame->data + index, length);
+
+	return length;
+}
+
+// Called by the decoder: once with the scaled image size and no data, then per decoded block of RGB888 pixels
+bool motion_detector::write_pixels(void *arg, uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint8_t *data)
+{
+	auto self = static_cast<decode_context *>(arg)->detector;
+	if (!data)
+	{
+		if (x == 0 && y == 0)
+		{
+			self->scaled_width_ = width;
+			self->scaled_height_ = height;
+		}
+
+		return true;
+	}
+
+	for (uint16_t row = 0; row < height; ++row)
+	{
+		auto cell_row = (y + row) * grid_height / self->scaled_height_ * grid_width;
+		for (uint16_t column = 0; column < width; ++column, data += 3)
+		{
+			auto cell = cell_row + (x + column) * grid_width / self->scaled_width_;
+			// ITU-R BT.601 luma in integer arithmetic
+			self->sums_[cell] += (77 * data[0] + 150 * data[1] + 29 * data[2]) >> 8;
+			++self->counts_[cell];
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <camera_capture.h>
+#include <frame_diff.h>
+
+// Compares a downscaled grayscale image of the newest frame with the previous one on a low priority task
+class motion_detector
+{
+public:
+	// The frame is reduced to a grid of cells, each holding the mean luma of its pixels
+	static const size_t grid_width = 32;
+	static const size_t grid_height = 24;
+	static const size_t grid_size = grid_width * grid_height;
+
+private:
+	// Passed through the JPEG decoder to its callbacks
+	struct decode_context
+	{
+		motion_detector *detector;
+		const camera_capture::frame *frame;
+	};
+
+	camera_capture &capture_;
+	TaskHandle_t task_;
+
+	volatile bool enabled_;
+	uint32_t interval_ms_;
+	// Mean absolute luma difference per cell (0-255) that counts as motion
+	volatile uint8_t threshold_;
+	// Motion stays active for this long after the last sample above the threshold
+	uint32_t hold_ms_;
+
+	// Decoder accumulators, only used by the task
+	uint32_t sums_[grid_size];
+	uint16_t counts_[grid_size];
+	uint16_t scaled_width_;
+	uint16_t scaled_height_;
+	// Cells of the previous sample and of the current one
+	uint8_t reference_[grid_size];
+	uint8_t current_[grid_size];
+	bool reference_valid_;
+	uint16_t reference_width_;
+
+	volatile uint8_t score_;
+	volatile bool motion_;
+	volatile uint32_t last_motion_;
+	volatile uint32_t events_;
+
+	static void task(void *parameter);
+	static size_t read_jpeg(void *arg, size_t index, uint8_t *buffer, size_t length);
+	static bool write_pixels(void *arg, uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint8_t *data);
+	void detect_loop();
+	bool sample(const camera_capture::frame &frame);
+
+public:
+	motion_detector(camera_capture &capture, uint32_t interval_ms = 200, uint8_t threshold = 6, uint32_t hold_ms = 5000);
+
+	// Start the detection task. It keeps the camera capturing while enabled
+	bool begin(BaseType_t core = 0);
+
+	bool enabled() const { return enabled_; }
+	void set_enabled(bool enabled);
+	uint8_t threshold() const { return threshold_; }
+	void set_threshold(uint8_t threshold) { threshold_ = threshold; }
+
+	// True while motion was seen within the hold time
+	bool motion() const { return motion_; }
+	// Score of the last sample, the mean absolute luma difference per cell
+	uint8_t score() const { return score_; }
+	// millis() of the last sample above the threshold
+	uint32_t last_motion() const { return last_motion_; }
+	// Transitions from no motion to motion
+	uint32_t events() const { return events_; }
+};
@@ -0,0 +1,374 @@
+#include "recorder.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <esp32-hal-log.h>
+#include <esp_heap_caps.h>
+#include <lwip/sockets.h>
+#include <SD_MMC.h>
+#include <metrics.h>
+
+static const char mount_point[] = "/sdcard";
+static const char directory[] = "/sdcard/recordings";
+static const char clip_header[] = "HTTP/1.1 200 OK\r\n"
+								  "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+								  "Connection: close\r\n\r\n";
+static const char part_trailer[] = "\r\n";
+
+recorder::clip_reader::clip_reader(const WiFiClient &client, size_t segment, uint32_t generation, uint32_t offset, uint32_t end)
+	: wifi_client(client), segment(segment), generation(generation), offset(offset), end(end), fd(-1), size(0), sent(0)
+{
+	size = sizeof(clip_header) - 1;
+	memcpy(buffer, clip_header, size);
+}
+
+recorder::clip_reader::~clip_reader()
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+recorder::recorder(camera_capture &capture, size_t segments /*= 8*/, uint32_t segment_bytes /*= 8 * 1024 * 1024*/, uint32_t msec_per_frame /*= 200*/)
+	: capture_(capture), msec_per_frame_(msec_per_frame), segment_bytes_(segment_bytes), segments_(segments), task_(nullptr),
+	  block_(nullptr), block_fill_(0), current_(0), fd_(-1), block_offset_(0)
+{
+	for (auto &s : segments_)
+		s = segment{0, {0, 0, 0}, {}};
+}
+
+bool recorder::begin(BaseType_t core /*= 0*/)
+{
+	if (!SD_MMC.begin(mount_point, true))
+	{
+		log_w("No SD card, recording disabled");
+		return false;
+	}
+
+	// The index never grows while recording, so the loop can read it under a spinlock
+	for (auto &s : segments_)
+		s.index.reserve(index_capacity);
+
+	block_ = static_cast<uint8_t *>(heap_caps_malloc(block_size, MALLOC_CAP_DMA));
+	if (block_ == nullptr || !preallocate())
+		return false;
+
+	log_i("Recording %u segments of %u bytes", segments_.size(), segment_bytes_);
+	return xTaskCreatePinnedToCore(task, "recorder", 4096, this, 1, &task_, core) == pdPASS;
+}
+
+String recorder::path(size_t segment) const
+{
+	return String(directory) + "/segment" + String(segment) + ".mjpeg";
+}
+
+// Extending the files once up front allocates their clusters, recording then only overwrites them in place
+bool recorder::preallocate()
+{
+	mkdir(directory, 0755);
+	for (size_t i = 0; i < segments_.size(); ++i)
+	{
+		auto fd = open(path(i).c_str(), O_RDWR | O_CREAT, 0644);
+		if (fd < 0)
+		{
+			log_e("Unable to create %s", path(i).c_str());
+			return false;
+		}
+
+		struct stat status;
+		auto ok = fstat(fd, &status) == 0;
+		if (ok && status.st_size < static_cast<off_t>(segment_bytes_))
+		{
+			log_i("Preallocating %s", path(i).c_str());
+			uint8_t zero = 0;
+			ok = lseek(fd, segment_bytes_ - 1, SEEK_SET) >= 0 && write(fd, &zero, 1) == 1;
+		}
+
+		close(fd);
+		if (!ok)
+		{
+			log_e("Unable to preallocate %s", path(i).c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void recorder::task(void *parameter)
+{
+	static_cast<recorder *>(parameter)->record_loop();
+}
+
+void recorder::record_loop()
+{
+	open_segment(0);
+	uint32_t last_sequence = 0;
+	auto period = pdMS_TO_TICKS(msec_per_frame_);
+	auto wake = xTaskGetTickCount();
+	while (true)
+	{
+		// A write that took longer than a frame interval loses the frames in between
+		auto now = xTaskGetTickCount();
+		if (now - wake > period)
+		{
+			metrics.recorder_frames_dropped.inc((now - wake) / period);
+			wake = now;
+		}
+
+		vTaskDelayUntil(&wake, period);
+		auto frame = capture_.latest();
+		if (!frame || frame->sequence == last_sequence)
+			continue;
+
+		last_sequence = frame->sequence;
+		record(*frame);
+	}
+}
+
+bool recorder::open_segment(size_t segment)
+{
+	if (fd_ >= 0)
+		close(fd_);
+
+	portENTER_CRITICAL(&lock_);
+	current_ = segment;
+	++segments_[segment].generation;
+	segments_[segment].info = {0, 0, 0};
+	segments_[segment].index.clear();
+	portEXIT_CRITICAL(&lock_);
+
+	block_offset_ = 0;
+	block_fill_ = 0;
+	fd_ = open(path(segment).c_str(), O_WRONLY);
+	if (fd_ < 0)
+		log_e("Unable to open %s", path(segment).c_str());
+
+	return fd_ >= 0;
+}
+
+void recorder::append(const void *data, size_t size)
+{
+	auto bytes = static_cast<const uint8_t *>(data);
+	while (size > 0)
+	{
+		auto n = std::min(size, block_size - block_fill_);
+		memcpy(block_ + block_fill_, bytes, n);
+		block_fill_ += n;
+		bytes += n;
+		size -= n;
+		if (block_fill_ == block_size)
+			write_block();
+	}
+}
+
+bool recorder::write_block()
+{
+	auto start = micros();
+	auto ok = fd_ >= 0 && write(fd_, block_, block_size) == static_cast<ssize_t>(block_size);
+	metrics.recorder_write_time.observe(micros() - start);
+	if (!ok)
+		log_e("Writing to segment %u failed", current_);
+
+	// Keep going on a failed write, the block is lost but the offsets stay aligned
+	block_offset_ += block_size;
+	block_fill_ = 0;
+	portENTER_CRITICAL(&lock_);
+	segments_[current_].info.length = block_offset_;
+	portEXIT_CRITICAL(&lock_);
+	return ok;
+}
+
+// Write the partial last block padded to the block size; the padding is not part of the segment
+void recorder::finish_segment()
+{
+	uint32_t length = block_offset_ + block_fill_;
+	if (block_fill_ > 0)
+	{
+		memset(block_ + block_fill_, 0, block_size - block_fill_);
+		write_block();
+	}
+
+	portENTER_CRITICAL(&lock_);
+	segments_[current_].info.length = length;
+	portEXIT_CRITICAL(&lock_);
+}
+
+void recorder::record(const camera_capture::frame &frame)
+{
+	char part_header[80];
+	auto part_header_size = snprintf(part_header, sizeof(part_header), "--frame\r\n"
+																	   "Content-Type: image/jpeg\r\n"
+																	   "Content-Length: %u\r\n\r\n",
+									 frame.size);
+	auto size = part_header_size + frame.size + sizeof(part_trailer) - 1;
+	if (size > segment_bytes_)
+		return;
+
+	// Rotate the oldest segment out when this one is full
+	uint32_t offset = block_offset_ + block_fill_;
+	if (offset + size > segment_bytes_)
+	{
+		finish_segment();
+		open_segment((current_ + 1) % segments_.size());
+		offset = 0;
+	}
+
+	auto &s = segments_[current_];
+	portENTER_CRITICAL(&lock_);
+	if (s.index.empty())
+		s.info.start = frame.timestamp;
+	if (s.index.size() < index_capacity && (s.index.empty() || frame.timestamp - s.index.back().timestamp >= 1000))
+		s.index.push_back({frame.timestamp, offset});
+	portEXIT_CRITICAL(&lock_);
+
+	append(part_header, part_header_size);
+	append(frame.data, frame.size);
+	append(part_trailer, sizeof(part_trailer) - 1);
+	metrics.recorder_frames.inc();
+	metrics.recorder_bytes.inc(size);
+
+	portENTER_CRITICAL(&lock_);
+	s.info.end = frame.timestamp;
+	portEXIT_CRITICAL(&lock_);
+}
+
+std::vector<recorder::segment_info> recorder::segments() const
+{
+	std::vector<segment_info> result;
+	result.reserve(segments_.size());
+	// Oldest first
+	portENTER_CRITICAL(&lock_);
+	for (size_t i = 1; i <= segments_.size(); ++i)
+	{
+		auto &s = segments_[(current_ + i) % segments_.size()];
+		if (s.info.length > 0)
+			result.push_back(s.info);
+	}
+	portEXIT_CRITICAL(&lock_);
+	return result;
+}
+
+bool recorder::add_clip(const WiFiClient &client, uint32_t start, uint32_t end)
+{
+	if (!recording())
+		return false;
+
+	auto found = false;
+	size_t segment = 0;
+	uint32_t generation = 0;
+	uint32_t offset = 0;
+	portENTER_CRITICAL(&lock_);
+	// First segment, oldest first, with frames in the range. Start at the last index entry before the start
+	for (size_t i = 1; i <= segments_.size() && !found; ++i)
+	{
+		segment = (current_ + i) % segments_.size();
+		auto &s = segments_[segment];
+		if (s.info.length == 0 || s.index.empty() || s.info.end < start || s.info.start > end)
+			continue;
+
+		found = true;
+		generation = s.generation;
+		offset = s.index.front().offset;
+		for (const auto &entry : s.index)
+			if (entry.timestamp <= start)
+				offset = entry.offset;
+	}
+	portEXIT_CRITICAL(&lock_);
+
+	if (!found)
+		return false;
+
+	log_i("Adding clip reader from segment %u", segment);
+	readers_.push_back(std::unique_ptr<clip_reader>(new clip_reader(client, segment, generation, offset, end)));
+	return true;
+}
+
+// Called with the lock held
+uint32_t recorder::limit(const segment &s, uint32_t end) const
+{
+	for (const auto &entry : s.index)
+		if (entry.timestamp > end)
+			return std::min(entry.offset, s.info.length);
+
+	return s.info.length;
+}
+
+// Read the next chunk of the clip into the buffer. Returns false when the clip is complete or was overwritten
+bool recorder::fill(clip_reader &reader)
+{
+	uint32_t available = 0;
+	auto next_segment = false;
+	portENTER_CRITICAL(&lock_);
+	auto &s = segments_[reader.segment];
+	if (s.generation == reader.generation)
+	{
+		auto end = limit(s, reader.end);
+		if (reader.offset < end)
+			available = end - reader.offset;
+		else
+		{
+			// Continue in the next segment if it is newer and the clip goes on
+			auto next = (reader.segment + 1) % segments_.size();
+			auto &n = segments_[next];
+			if (reader.segment != current_ && end == s.info.length && n.info.length > 0 && n.info.start >= s.info.end && n.info.start <= reader.end)
+			{
+				next_segment = true;
+				reader.segment = next;
+				reader.generation = n.generation;
+				reader.offset = 0;
+			}
+		}
+	}
+	portEXIT_CRITICAL(&lock_);
+
+	if (next_segment)
+	{
+		if (reader.fd >= 0)
+			close(reader.fd);
+		reader.fd = -1;
+		return fill(reader);
+	}
+
+	if (available == 0)
+		return false;
+
+	if (reader.fd < 0 && (reader.fd = open(path(reader.segment).c_str(), O_RDONLY)) < 0)
+		return false;
+
+	auto read_size = pread(reader.fd, reader.buffer, std::min<uint32_t>(available, sizeof(reader.buffer)), reader.offset);
+	if (read_size <= 0)
+		return false;
+
+	reader.offset += read_size;
+	reader.size = read_size;
+	reader.sent = 0;
+	return true;
+}
+
+void recorder::doLoop()
+{
+	// Check if any reader. If none: nothing to do
+	if (readers_.empty())
+		return;
+
+	for (const auto &reader : readers_)
+	{
+		if (reader->sent == reader->size && !fill(*reader))
+		{
+			// Clip complete, the response ends with the connection
+			reader->wifi_client.stop();
+			continue;
+		}
+
+		auto sent = send(reader->wifi_client.fd(), reader->buffer + reader->sent, reader->size - reader->sent, MSG_DONTWAIT);
+		if (sent > 0)
+			reader->sent += sent;
+		else if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			reader->wifi_client.stop();
+	}
+
+	readers_.remove_if(
+		[](std::unique_ptr<clip_reader> const &r)
+		{ return !r->wifi_client.connected(); });
+}
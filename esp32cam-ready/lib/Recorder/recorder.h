@@ -0,0 +1,104 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <vector>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <WiFiClient.h>
+#include <camera_capture.h>
+
+// Keeps the last minutes of MJPEG on the SD card in a ring of preallocated segment files.
+// Frames are stored as multipart parts, so any range between two parts is a playable stream
+class recorder
+{
+public:
+	struct segment_info
+	{
+		// millis() of the first and the last frame
+		uint32_t start;
+		uint32_t end;
+		// Bytes on the card
+		uint32_t length;
+	};
+
+private:
+	// One entry per second of footage, up to the capacity reserved in begin()
+	static const size_t index_capacity = 1024;
+	struct index_entry
+	{
+		uint32_t timestamp;
+		uint32_t offset;
+	};
+
+	struct segment
+	{
+		// Incremented when the segment is overwritten, so clip readers notice
+		uint32_t generation;
+		segment_info info;
+		std::vector<index_entry> index;
+	};
+
+	// Sends a clip to an HTTP client from the loop without blocking
+	struct clip_reader
+	{
+		WiFiClient wifi_client;
+		size_t segment;
+		uint32_t generation;
+		uint32_t offset;
+		// millis() of the last frame to send
+		uint32_t end;
+		// Open segment file
+		int fd;
+		uint8_t buffer[4096];
+		size_t size;
+		size_t sent;
+		clip_reader(const WiFiClient &client, size_t segment, uint32_t generation, uint32_t offset, uint32_t end);
+		~clip_reader();
+	};
+
+	camera_capture &capture_;
+	uint32_t msec_per_frame_;
+	uint32_t segment_bytes_;
+	std::vector<segment> segments_;
+	// Guards segments_ between the recording task and the loop
+	mutable portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+	TaskHandle_t task_;
+
+	// Writer state, only used by the task. Frames are collected into a DMA capable block
+	// and written in whole blocks, so the card only sees large aligned writes
+	static const size_t block_size = 16384;
+	uint8_t *block_;
+	size_t block_fill_;
+	size_t current_;
+	int fd_;
+	uint32_t block_offset_;
+
+	std::list<std::unique_ptr<clip_reader>> readers_;
+
+	static void task(void *parameter);
+	void record_loop();
+	String path(size_t segment) const;
+	bool preallocate();
+	bool open_segment(size_t segment);
+	void append(const void *data, size_t size);
+	bool write_block();
+	void finish_segment();
+	void record(const camera_capture::frame &frame);
+	// Byte offset in the segment up to which frames are not newer than end
+	uint32_t limit(const segment &s, uint32_t end) const;
+	bool fill(clip_reader &reader);
+
+public:
+	recorder(camera_capture &capture, size_t segments = 8, uint32_t segment_bytes = 8 * 1024 * 1024, uint32_t msec_per_frame = 200);
+
+	// Mount the SD card (1-bit mode, GPIO 4 stays the light), preallocate the segments and start the recording task
+	bool begin(BaseType_t core = 0);
+	bool recording() const { return task_ != nullptr; }
+
+	std::vector<segment_info> segments() const;
+	// Stream the frames from start to end (millis()) to the client. Returns false if there is no footage in the range
+	bool add_clip(const WiFiClient &client, uint32_t start, uint32_t end);
+
+	void doLoop();
+};
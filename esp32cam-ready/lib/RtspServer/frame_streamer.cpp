@@ -0,0 +1,15 @@
+#include "frame_streamer.h"
+
+frame_streamer::frame_streamer(SOCKET client, const camera_capture::frame_ptr &frame, u_short width, u_short height)
+	: CStreamer(client, width, height), frame_(frame), width_(width), height_(height)
+{
+}
+
+void frame_streamer::streamImage(uint32_t curMsec)
+{
+	// A frame with other dimensions would not decode with the header of this session
+	if (!frame_ || frame_->width != width_ || frame_->height != height_)
+		return;
+
+	streamFrame(frame_->data, frame_->size, curMsec);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <CStreamer.h>
+#include <camera_capture.h>
+
+// Streamer that sends the frame taken by the rtsp_server instead of capturing one itself
+class frame_streamer : public CStreamer
+{
+private:
+	const camera_capture::frame_ptr &frame_;
+	// Dimensions announced in the RTP/JPEG header, fixed for the session
+	u_short width_;
+	u_short height_;
+
+public:
+	frame_streamer(SOCKET client, const camera_capture::frame_ptr &frame, u_short width, u_short height);
+
+	void streamImage(uint32_t curMsec) override;
+};
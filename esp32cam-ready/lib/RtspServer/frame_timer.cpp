@@ -0,0 +1,86 @@
+#include "frame_timer.h"
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+frame_timer::frame_timer()
+	: timer_(nullptr), msec_per_frame_(0), due_(false), deadline_(0), misses_(0)
+{
+	esp_timer_create_args_t args = {};
+	args.callback = on_deadline;
+	args.arg = this;
+	args.name = "frame";
+	esp_timer_create(&args, &timer_);
+}
+
+frame_timer::~frame_timer()
+{
+	esp_timer_stop(timer_);
+	esp_timer_delete(timer_);
+	// A deadline already dispatched before the stop may still be running on_deadline on this object
+	wait_for_callbacks();
+}
+
+// The esp_timer task runs callbacks one after the other: once a callback queued now has run,
+// every callback started before it has returned
+void frame_timer::wait_for_callbacks()
+{
+	auto done = xSemaphoreCreateBinary();
+	if (done == nullptr)
+		return;
+
+	esp_timer_create_args_t args = {};
+	args.callback = [](void *arg)
+	{ xSemaphoreGive(static_cast<SemaphoreHandle_t>(arg)); };
+	args.arg = done;
+	args.name = "frame fence";
+	esp_timer_handle_t fence;
+	if (esp_timer_create(&args, &fence) == ESP_OK)
+	{
+		if (esp_timer_start_once(fence, 0) == ESP_OK)
+			xSemaphoreTake(done, portMAX_DELAY);
+		esp_timer_delete(fence);
+	}
+	vSemaphoreDelete(done);
+}
+
+// Runs in the esp_timer task
+void frame_timer::on_deadline(void *arg)
+{
+	auto timer = static_cast<frame_timer *>(arg);
+	timer->deadline_.store(esp_timer_get_time(), std::memory_order_relaxed);
+	// The previous deadline was never served
+	if (timer->due_.exchange(true, std::memory_order_release))
+		timer->misses_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void frame_timer::start(uint32_t msec_per_frame)
+{
+	if (active())
+	{
+		if (msec_per_frame == msec_per_frame_)
+			return;
+
+		esp_timer_stop(timer_);
+	}
+
+	msec_per_frame_ = msec_per_frame;
+	esp_timer_start_periodic(timer_, msec_per_frame * 1000ULL);
+}
+
+void frame_timer::stop()
+{
+	esp_timer_stop(timer_);
+	due_.store(false, std::memory_order_relaxed);
+}
+
+bool frame_timer::take()
+{
+	if (!due_.exchange(false, std::memory_order_acquire))
+		return false;
+
+	auto late = esp_timer_get_time() - deadline_.load(std::memory_order_relaxed);
+	if (late > msec_per_frame_ * 500LL)
+		misses_.fetch_add(1, std::memory_order_relaxed);
+
+	return true;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <esp_timer.h>
+
+// Marks the frame deadlines of one stream from an esp_timer, so the pacing
+// does not depend on how often the loop gets around to compare millis()
+class frame_timer
+{
+private:
+	esp_timer_handle_t timer_;
+	uint32_t msec_per_frame_;
+	// Set by the timer at a deadline, cleared by take()
+	std::atomic<bool> due_;
+	std::atomic<int64_t> deadline_;
+	std::atomic<uint32_t> misses_;
+
+	static void on_deadline(void *arg);
+	static void wait_for_callbacks();
+
+public:
+	frame_timer();
+	~frame_timer();
+	frame_timer(const frame_timer &) = delete;
+	frame_timer &operator=(const frame_timer &) = delete;
+
+	// (Re)starts the periodic deadlines; does nothing if already running at this interval
+	void start(uint32_t msec_per_frame);
+	void stop();
+	bool active() const { return esp_timer_is_active(timer_); }
+
+	bool due() const { return due_.load(std::memory_order_acquire); }
+	// Consumes the pending deadline; counts a miss if it is served later than half the interval
+	bool take();
+	// Deadlines that passed while the previous one was pending or that were served late
+	uint32_t misses() const { return misses_.load(std::memory_order_relaxed); }
+};
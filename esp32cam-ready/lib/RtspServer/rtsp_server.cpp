@@ -1,18 +1,51 @@
 #include "rtsp_server.h"
+#include <algorithm>
 #include <esp32-hal-log.h>
 #include <ESPmDNS.h>
-#include <OV2640Streamer.h>
+#include <lwip/sockets.h>
+#include <metrics.h>
 
-rtsp_server::rtsp_client::rtsp_client(const WiFiClient &client, OV2640 &cam)
+// Slowest rate a congested client is paced down to: 0.5 fps
+static const uint32_t max_msec_per_frame = 2000;
+
+rtsp_server::rtsp_client::rtsp_client(const WiFiClient &client, const camera_capture::frame_ptr &frame, const camera_capture &capture, uint32_t msec_per_frame)
+	: msec_per_frame(msec_per_frame), last_sequence(0),
+	  stats{client.remoteIP(), msec_per_frame, 0, 0, 0, 0, 0, 0}, window_start(millis()), window_frames(0), window_bytes(0)
 {
 	wifi_client = client;
-	streamer = std::shared_ptr<CStreamer>(new OV2640Streamer(&wifi_client, cam));
+	streamer = std::shared_ptr<CStreamer>(new frame_streamer(&wifi_client, frame, capture.width(), capture.height()));
 	session = std::shared_ptr<CRtspSession>(new CRtspSession(&wifi_client, streamer.get()));
 }
 
+// True if the previous frame has left the socket send buffer
+bool rtsp_server::rtsp_client::writable()
+{
+	auto fd = wifi_client.fd();
+	fd_set write_fds;
+	FD_ZERO(&write_fds);
+	FD_SET(fd, &write_fds);
+	timeval timeout = {0, 0};
+	return select(fd + 1, nullptr, &write_fds, nullptr, &timeout) > 0;
+}
+
+void rtsp_server::rtsp_client::update_stats(uint32_t now)
+{
+	stats.msec_per_frame = msec_per_frame;
+	stats.deadline_misses = timer.misses();
+	auto elapsed = now - window_start;
+	if (elapsed < 1000)
+		return;
+
+	stats.fps = window_frames * 1000.0f / elapsed;
+	stats.bytes_per_second = static_cast<uint64_t>(window_bytes) * 1000 / elapsed;
+	window_start = now;
+	window_frames = 0;
+	window_bytes = 0;
+}
+
 // URI: e.g. rtsp://192.168.178.27:554/mjpeg/1
-rtsp_server::rtsp_server(OV2640 &cam, int port /*= 554*/)
-	: WiFiServer(port), cam_(cam)
+rtsp_server::rtsp_server(camera_capture &capture, int port /*= 554*/)
+	: WiFiServer(port), capture_(capture), msec_per_frame_(200)
 {
 }
 
@@ -25,12 +58,38 @@ void rtsp_server::begin()
 	MDNS.addService("rtsp", "tcp", 554);
 }
 
+void rtsp_server::set_frame_rate(uint32_t fps)
+{
+	fps = std::max<uint32_t>(1, std::min<uint32_t>(fps, 30));
+	log_i("Setting RTSP frame rate to %u fps", fps);
+	msec_per_frame_ = 1000 / fps;
+	// Clients adapt from the new target
+	for (const auto &client : clients_)
+		client->msec_per_frame = msec_per_frame_;
+}
+
+bool rtsp_server::congested() const
+{
+	return std::any_of(clients_.begin(), clients_.end(),
+					   [this](std::unique_ptr<rtsp_client> const &c)
+					   { return c->msec_per_frame > msec_per_frame_; });
+}
+
+std::list<rtsp_server::client_stats> rtsp_server::stats() const
+{
+	std::list<client_stats> result;
+	for (const auto &client : clients_)
+		result.push_back(client->stats);
+
+	return result;
+}
+
 void rtsp_server::doLoop()
 {
 	// Check if a client wants to connect
 	auto new_client = accept();
 	if (new_client)
-		clients_.push_back(std::unique_ptr<rtsp_client>(new rtsp_client(new_client, cam_)));
+		clients_.push_back(std::unique_ptr<rtsp_client>(new rtsp_client(new_client, frame_, capture_, msec_per_frame_)));
 
 	// Check if any client connected. If none: nothing to do
 	if (clients_.empty())
@@ -39,24 +98,72 @@ void rtsp_server::doLoop()
 	for (const auto &client : clients_)
 		client->session->handleRequests(0);
 
-	// 200ms => 5fps
-	const auto msec_per_frame = 200;
-	static auto last_image = millis();
+	// Each client is paced by its own timer, running only while the client plays.
+	// Only ask for frames if a client is due, otherwise the capture task idles
+	for (const auto &client : clients_)
+		if (client->session->m_streaming && !client->session->m_stopped)
+			client->timer.start(client->msec_per_frame);
+		else
+			client->timer.stop();
+
 	auto now = millis();
-	if (now > last_image + msec_per_frame || now < last_image)
+	auto due = [](std::unique_ptr<rtsp_client> const &c)
+	{ return c->timer.due(); };
+	if (std::any_of(clients_.begin(), clients_.end(), due))
 	{
-		// Send the frame
-		last_image = now;
-		for (const auto &client : clients_)
-			client->session->broadcastCurrentFrame(now);
-
-		// check if we are overrunning our max frame rate
-		now = millis();
-		if (now > last_image + msec_per_frame)
-			log_w("warning exceeding max frame rate of %lu ms", now - last_image);
+		// Take the newest frame once and send it to all clients that are due
+		frame_ = capture_.latest();
+		if (frame_)
+			for (const auto &client : clients_)
+				// Take the deadline even without a new frame, left pending it would count as a miss
+				if (client->timer.take() && client->last_sequence != frame_->sequence)
+					send_frame(*client, now);
+
+		// Give the buffer back to the ring
+		frame_.reset();
 	}
 
+	for (const auto &client : clients_)
+		client->update_stats(now);
+
 	clients_.remove_if(
 		[](std::unique_ptr<rtsp_client> const &c)
 		{ return c->session->m_stopped; });
 }
+
+void rtsp_server::send_frame(rtsp_client &client, uint32_t now)
+{
+	// Skip the frame if the client did not drain the previous one and back off
+	if (!client.writable())
+	{
+		++client.stats.dropped;
+		metrics.rtsp_frames_dropped.inc();
+		client.msec_per_frame = std::min<uint32_t>(client.msec_per_frame * 3 / 2, max_msec_per_frame);
+		log_d("Client %s congested, %u ms per frame", client.stats.address.toString().c_str(), client.msec_per_frame);
+		return;
+	}
+
+	auto start = micros();
+	client.session->broadcastCurrentFrame(now);
+	auto elapsed_usec = micros() - start;
+	auto elapsed = elapsed_usec / 1000;
+	metrics.rtsp_send_time.observe(elapsed_usec);
+	metrics.rtsp_frames_sent.inc();
+	metrics.rtsp_bytes_sent.inc(frame_->size);
+
+	client.last_sequence = frame_->sequence;
+	++client.stats.frames;
+	++client.window_frames;
+	client.window_bytes += frame_->size;
+
+	if (elapsed > client.msec_per_frame / 2)
+	{
+		// Write stalled: lower the rate for this client only
+		++client.stats.stalls;
+		metrics.rtsp_send_stalls.inc();
+		client.msec_per_frame = std::min<uint32_t>(client.msec_per_frame * 5 / 4, max_msec_per_frame);
+	}
+	else if (client.msec_per_frame > msec_per_frame_)
+		// Recover slowly towards the target
+		client.msec_per_frame = std::max<uint32_t>(client.msec_per_frame - 10, msec_per_frame_);
+}
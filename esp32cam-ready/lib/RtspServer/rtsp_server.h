@@ -3,28 +3,76 @@
 #include <list>
 #include <WiFiServer.h>
 #include <ESPmDNS.h>
-#include <OV2640.h>
+#include <camera_capture.h>
 #include <CRtspSession.h>
+#include "frame_streamer.h"
+#include "frame_timer.h"
 
 class rtsp_server : public WiFiServer
 {
+public:
+	struct client_stats
+	{
+		IPAddress address;
+		// Current paced interval; larger than the target when the client cannot keep up
+		uint32_t msec_per_frame;
+		float fps;
+		uint32_t bytes_per_second;
+		uint32_t frames;
+		// Frames skipped because the socket was still busy with the previous one
+		uint32_t dropped;
+		// Frames that took longer than half the interval to write
+		uint32_t stalls;
+		// Frame deadlines served late or not at all
+		uint32_t deadline_misses;
+	};
+
 private:
 	struct rtsp_client
 	{
 		WiFiClient wifi_client;
 		// Streamer for UDP/TCP based RTP transport
-		std::shared_ptr<CRtspSession> session;
-		// RTSP session and state
 		std::shared_ptr<CStreamer> streamer;
-		rtsp_client(const WiFiClient &client, OV2640 &cam);
+		// RTSP session and state
+		std::shared_ptr<CRtspSession> session;
+
+		// Pacing
+		uint32_t msec_per_frame;
+		frame_timer timer;
+		uint32_t last_sequence;
+
+		// Statistics
+		client_stats stats;
+		uint32_t window_start;
+		uint32_t window_frames;
+		uint32_t window_bytes;
+
+		rtsp_client(const WiFiClient &client, const camera_capture::frame_ptr &frame, const camera_capture &capture, uint32_t msec_per_frame);
+		bool writable();
+		void update_stats(uint32_t now);
 	};
 
-	OV2640 &cam_;
+	camera_capture &capture_;
+	// Frame taken once per tick and sent to all clients that are due
+	camera_capture::frame_ptr frame_;
 	std::list<std::unique_ptr<rtsp_client>> clients_;
 
+	// Target interval; each client is paced between this and the slowest allowed interval
+	uint32_t msec_per_frame_;
+
+	void send_frame(rtsp_client &client, uint32_t now);
+
 public:
-	rtsp_server(OV2640 &cam, int port = 554);
+	rtsp_server(camera_capture &capture, int port = 554);
 	void begin();
 
+	uint32_t frame_rate() const { return 1000 / msec_per_frame_; }
+	void set_frame_rate(uint32_t fps);
+
+	size_t clients() const { return clients_.size(); }
+	// True if a client is paced slower than the target rate
+	bool congested() const;
+	std::list<client_stats> stats() const;
+
 	void doLoop();
 };
@@ -1,33 +1,221 @@
 #include "wifi_provisioning.h"
+#include <algorithm>
+#include <vector>
+#include <Preferences.h>
+#include <esp_wifi.h>
+#include <freertos/semphr.h>
+#include <ping/ping_sock.h>
+#include "form_html.h"
+
+// NVS namespace of the last good connection
+static const char preferences_namespace[] = "fast_connect";
+// Time for a directed connect before falling back to the scan
+static const uint32_t fast_connect_timeout_ms = 3000;
+// The cached DHCP lease is reused as a static address for this many boots, then renewed
+static const uint16_t max_lease_reuse = 20;
+// Time for the gateway to answer a ping after a fast connect
+static const uint32_t gateway_timeout_ms = 500;
+// Portal: interval of the background scans and time to validate submitted credentials
+static const uint32_t scan_interval_ms = 30000;
+static const uint32_t validate_timeout_ms = 15000;
+// Time for the browser to see the result before the restart
+static const uint32_t restart_delay_ms = 3000;
+
+// Last good connection, stored in NVS
+struct connection_cache
+{
+    uint8_t bssid[6];
+    int32_t channel;
+    uint32_t ip;
+    uint32_t gateway;
+    uint32_t subnet;
+    uint32_t dns;
+    uint16_t reused;
+};
+
+// Station credentials saved by the driver in handle_root_post
+static bool stored_credentials(wifi_config_t &config)
+{
+    return esp_wifi_get_config(WIFI_IF_STA, &config) == ESP_OK && config.sta.ssid[0] != 0;
+}
+
+// One ping, so a static address taken over by another host is noticed
+static bool gateway_answers(IPAddress gateway)
+{
+    struct ping_result
+    {
+        SemaphoreHandle_t done;
+        volatile bool replied;
+    } result = {xSemaphoreCreateBinary(), false};
+    if (result.done == nullptr)
+        return false;
+
+    esp_ping_config_t config = ESP_PING_DEFAULT_CONFIG();
+    config.target_addr.type = IPADDR_TYPE_V4;
+    config.target_addr.u_addr.ip4.addr = static_cast<uint32_t>(gateway);
+    config.count = 1;
+    config.timeout_ms = gateway_timeout_ms;
+    esp_ping_callbacks_t callbacks = {};
+    callbacks.cb_args = &result;
+    callbacks.on_ping_success = [](esp_ping_handle_t, void *arg)
+    { static_cast<ping_result *>(arg)->replied = true; };
+    callbacks.on_ping_end = [](esp_ping_handle_t, void *arg)
+    { xSemaphoreGive(static_cast<ping_result *>(arg)->done); };
+
+    esp_ping_handle_t ping;
+    if (esp_ping_new_session(&config, &callbacks, &ping) == ESP_OK)
+    {
+        esp_ping_start(ping);
+        xSemaphoreTake(result.done, pdMS_TO_TICKS(2 * gateway_timeout_ms));
+        esp_ping_stop(ping);
+        esp_ping_delete_session(ping);
+    }
+    vSemaphoreDelete(result.done);
+    return result.replied;
+}
+
+static void clear_cache()
+{
+    Preferences preferences;
+    preferences.begin(preferences_namespace);
+    preferences.remove("cache");
+    preferences.end();
+}
+
+// Escape a value for use in a JSON string
+static String json_escape(const String &value)
+{
+    String escaped;
+    escaped.reserve(value.length());
+    for (unsigned int index = 0; index < value.length(); ++index)
+    {
+        auto c = value[index];
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        if (static_cast<unsigned char>(c) < 0x20)
+            continue;
+        escaped += c;
+    }
+
+    return escaped;
+}
 
 wifi_provisioning::wifi_provisioning(const String &instance_name, const String &base_url /* = "/provisioning" */)
-    : instance_name_(instance_name), base_url_(base_url)
+    : instance_name_(instance_name), base_url_(base_url), networks_json_("[]"), last_scan_(0),
+      connect_state_(connect_state::idle), connect_started_(0)
 {
     server_.on(base_url_, HTTP_GET, std::bind(&wifi_provisioning::handle_root_get, this));
     server_.on(base_url_, HTTP_POST, std::bind(&wifi_provisioning::handle_root_post, this));
+    server_.on(base_url_ + "/config", HTTP_GET, std::bind(&wifi_provisioning::handle_config, this));
+    server_.on(base_url_ + "/status", HTTP_GET, std::bind(&wifi_provisioning::handle_status, this));
     server_.onNotFound(std::bind(&wifi_provisioning::handle_unknown, this));
 }
 
 wl_status_t wifi_provisioning::connect(int seconds /* = 30 */)
 {
+    auto start = millis();
     WiFi.mode(WIFI_STA);
-    auto connect_result = WiFi.begin();
-    while ((connect_result != WL_CONNECTED) && seconds-- > 0)
+    if (fast_connect())
     {
-        log_i("Connecting %d seconds left...", seconds);
-        delay(1000);
-        connect_result = WiFi.status();
+        log_i("Fast connect in %lu ms, %lu ms after boot", millis() - start, millis());
+        return WL_CONNECTED;
     }
 
-    log_i("Connection result: %d", connect_result);
+    // Full scan with DHCP. The credentials are passed again so the BSSID and channel
+    // of the fast connect, kept in the driver config, are cleared
+    WiFi.disconnect();
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
+    wifi_config_t config;
+    if (stored_credentials(config))
+        WiFi.begin(reinterpret_cast<const char *>(config.sta.ssid), reinterpret_cast<const char *>(config.sta.password));
+    else
+        WiFi.begin();
+    auto connect_result = wait_connected(seconds * 1000);
+    log_i("Connection result: %d in %lu ms, %lu ms after boot", connect_result, millis() - start, millis());
+    if (connect_result == WL_CONNECTED)
+        save_connection();
+
     return connect_result;
 }
 
+// Poll often, a connection is usually there in a fraction of a second
+wl_status_t wifi_provisioning::wait_connected(uint32_t timeout_ms)
+{
+    auto start = millis();
+    auto status = WiFi.status();
+    while (status != WL_CONNECTED && millis() - start < timeout_ms)
+    {
+        delay(10);
+        status = WiFi.status();
+    }
+
+    return status;
+}
+
+// Directed connect to the cached access point and channel with the cached IP configuration, skipping the scan and DHCP
+bool wifi_provisioning::fast_connect()
+{
+    connection_cache cache;
+    Preferences preferences;
+    preferences.begin(preferences_namespace, true);
+    auto cached = preferences.getBytes("cache", &cache, sizeof(cache)) == sizeof(cache);
+    preferences.end();
+
+    wifi_config_t config;
+    if (!cached || !stored_credentials(config))
+        return false;
+
+    // The last DHCP lease is reused as a static address to save the DHCP round trip. It is
+    // renewed after max_lease_reuse boots; provisioning, a failed fast connect or a silent
+    // gateway drop it earlier
+    if (cache.reused >= max_lease_reuse)
+    {
+        log_i("Cached lease used %u times, renewing", cache.reused);
+        clear_cache();
+        return false;
+    }
+
+    log_i("Fast connect to channel %d", cache.channel);
+    WiFi.config(IPAddress(cache.ip), IPAddress(cache.gateway), IPAddress(cache.subnet), IPAddress(cache.dns));
+    WiFi.begin(reinterpret_cast<const char *>(config.sta.ssid), reinterpret_cast<const char *>(config.sta.password), cache.channel, cache.bssid);
+    if (wait_connected(fast_connect_timeout_ms) == WL_CONNECTED && gateway_answers(IPAddress(cache.gateway)))
+    {
+        ++cache.reused;
+        preferences.begin(preferences_namespace);
+        preferences.putBytes("cache", &cache, sizeof(cache));
+        preferences.end();
+        return true;
+    }
+
+    log_w("Fast connect failed, scanning");
+    clear_cache();
+    return false;
+}
+
+void wifi_provisioning::save_connection()
+{
+    connection_cache cache;
+    memcpy(cache.bssid, WiFi.BSSID(), sizeof(cache.bssid));
+    cache.channel = WiFi.channel();
+    cache.ip = WiFi.localIP();
+    cache.gateway = WiFi.gatewayIP();
+    cache.subnet = WiFi.subnetMask();
+    cache.dns = WiFi.dnsIP();
+    cache.reused = 0;
+
+    Preferences preferences;
+    preferences.begin(preferences_namespace);
+    preferences.putBytes("cache", &cache, sizeof(cache));
+    preferences.end();
+}
+
 void wifi_provisioning::start_portal(const String &ap_password /*= "" */)
 {
     log_i("Starting portal");
     WiFi.setAutoConnect(false);
 
+    // Station stays up to validate credentials while the portal is served
+    WiFi.mode(WIFI_AP_STA);
     WiFi.softAP(instance_name_.c_str(), ap_password.length() ? ap_password.c_str() : nullptr);
     auto ip_address = WiFi.softAPIP();
     log_i("AP IP address: %s", ip_address.toString().c_str());
@@ -40,12 +228,100 @@ void wifi_provisioning::start_portal(const String &ap_password /*= "" */)
 
     // Scan available networks (async)
     WiFi.scanNetworks(true);
+    last_scan_ = millis();
 }
 
 void wifi_provisioning::doLoop()
 {
     dns_server_.processNextRequest();
     server_.handleClient();
+    update_scan();
+    update_connect();
+}
+
+// Rescan in the background and keep the result, so page loads never wait for or walk the scan
+void wifi_provisioning::update_scan()
+{
+    auto ssid_items = WiFi.scanComplete();
+    if (ssid_items == WIFI_SCAN_RUNNING)
+        return;
+
+    if (ssid_items >= 0)
+    {
+        log_i("ssid Items: %d", ssid_items);
+        // Strongest access point per SSID, hidden networks left out
+        std::vector<std::pair<int32_t, String>> networks;
+        for (auto index = 0; index < ssid_items; ++index)
+        {
+            auto ssid = WiFi.SSID(index);
+            auto rssi = WiFi.RSSI(index);
+            if (ssid.length() == 0)
+                continue;
+
+            auto existing = std::find_if(networks.begin(), networks.end(), [&ssid](const std::pair<int32_t, String> &n)
+                                         { return n.second == ssid; });
+            if (existing == networks.end())
+                networks.emplace_back(rssi, ssid);
+            else if (rssi > existing->first)
+                existing->first = rssi;
+        }
+
+        WiFi.scanDelete();
+        std::sort(networks.begin(), networks.end(), [](const std::pair<int32_t, String> &a, const std::pair<int32_t, String> &b)
+                  { return a.first > b.first; });
+
+        String json("[");
+        for (const auto &network : networks)
+        {
+            if (json.length() > 1)
+                json += ",";
+            json += "{\"ssid\":\"" + json_escape(network.second) + "\",\"rssi\":" + String(network.first) + "}";
+        }
+        json += "]";
+        networks_json_ = json;
+    }
+
+    // Scanning switches channels, not while credentials are validated
+    if (connect_state_ != connect_state::connecting && millis() - last_scan_ >= scan_interval_ms)
+    {
+        WiFi.scanNetworks(true);
+        last_scan_ = millis();
+    }
+}
+
+void wifi_provisioning::update_connect()
+{
+    auto elapsed = millis() - connect_started_;
+    switch (connect_state_)
+    {
+    case connect_state::connecting:
+    {
+        auto status = WiFi.status();
+        if (status == WL_CONNECTED)
+        {
+            log_i("Credentials valid, IP address: %s", WiFi.localIP().toString().c_str());
+            WiFi.setAutoConnect(true);
+            save_connection();
+            connect_state_ = connect_state::connected;
+            connect_started_ = millis();
+        }
+        else if (status == WL_CONNECT_FAILED || status == WL_NO_SSID_AVAIL || elapsed > validate_timeout_ms)
+        {
+            log_i("Connection result: %d", status);
+            WiFi.disconnect();
+            connect_state_ = connect_state::failed;
+        }
+        break;
+    }
+
+    case connect_state::connected:
+        if (elapsed > restart_delay_ms)
+            ESP.restart();
+        break;
+
+    default:
+        break;
+    }
 }
 
 void wifi_provisioning::handle_unknown()
@@ -60,55 +336,27 @@ void wifi_provisioning::handle_unknown()
 void wifi_provisioning::handle_root_get()
 {
     log_i("handle_root_get");
-    String ssid_options;
-    auto ssid_items = WiFi.scanComplete();
-    log_i("ssid Items: %d", ssid_items);
-    for (auto index = 0; index < ssid_items; ++index)
-    {
-        auto ssid = WiFi.SSID(index);
-        auto rssi = WiFi.RSSI(index);
-        log_i("Adding ssid: %s (%d dBm)", ssid.c_str(), rssi);
-        ssid_options += "<option value=\"" + ssid + "\">" + ssid + "(" + rssi + ")</option>";
-    }
+    // The form is static, the instance name and networks come from handle_config
+    server_.sendHeader("Content-Encoding", "gzip");
+    server_.sendHeader("Cache-Control", "max-age=86400");
+    server_.send_P(200, "text/html", reinterpret_cast<const char *>(form_html_gz), form_html_gz_len);
+}
 
-    String html(
-        "<!DOCTYPE html>"
-        "<html lang=\"en\">"
-        "<head>"
-        "<meta name=\"viewport\" content=\"width=device-width, initial-scale=1, shrink-to-fit=no\" />"
-        "<meta http-equiv=\"Pragma\" content=\"no-cache\">"
-        "<title>" +
-        instance_name_ +
-        "</title>"
-        "<style>"
-        "label {width:80px;display:block;float:left;clear:left;}"
-        "select,input,button {display:block;border-radius:5px;outline:none;}"
-        "</style>"
-        "</head>"
-        "<body>"
-        "<h1>" +
-        instance_name_ +
-        "</h1>"
-        "<hr>"
-        "<label for=\"ssids\">Found:</label>"
-        "<select name=\"ssids\" onchange=\"document.getElementsByName('ssid')[0].value=this.value\">"
-        "<option value=\"\"></option>" +
-        ssid_options +
-        "</select>"
-        "<br />"
-        "<form method=\"POST\">"
-        "<label for=\"ssid\">SSID:</label>"
-        "<input name=\"ssid\" type=\"text\">"
-        "<br />"
-        "<label for=\"password\">Password:</label>"
-        "<input name=\"password\" type=\"password\">"
-        "<br />"
-        "<input type=\"submit\" value=\"Submit\">"
-        "</form>"
-        "</body>"
-        "</html>");
-
-    server_.send(200, "text/html", html);
+void wifi_provisioning::handle_config()
+{
+    log_i("handle_config");
+    server_.send(200, "application/json", "{\"name\":\"" + json_escape(instance_name_) + "\",\"ssids\":" + networks_json_ + "}");
+}
+
+void wifi_provisioning::handle_status()
+{
+    static const char *const states[] = {"idle", "connecting", "connected", "failed"};
+    auto json = String("{\"state\":\"") + states[static_cast<int>(connect_state_)] + "\"";
+    if (connect_state_ == connect_state::connected)
+        json += ",\"ip\":\"" + WiFi.localIP().toString() + "\"";
+
+    json += "}";
+    server_.send(200, "application/json", json);
 }
 
 void wifi_provisioning::handle_root_post()
@@ -123,12 +371,16 @@ void wifi_provisioning::handle_root_post()
 
     log_i("SSID: %s, password: %s", ssid.c_str(), password.c_str());
 
-    WiFi.softAPdisconnect();
-    WiFi.mode(WIFI_STA);
+    // Another network: forget the last connection
+    clear_cache();
+
+    // Validated from doLoop, the browser polls the status
+    WiFi.disconnect();
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE);
     WiFi.begin(ssid.c_str(), password.c_str());
-    WiFi.setAutoConnect(true);
+    connect_state_ = connect_state::connecting;
+    connect_started_ = millis();
 
-    auto connection_result = (wl_status_t)WiFi.waitForConnectResult();
-    log_i("Connection result: %d", connection_result);
-    ESP.restart();
+    // Accepted
+    server_.send(202, "application/json", "{\"state\":\"connecting\"}");
 }
\ No newline at end of file
@@ -13,12 +13,38 @@ private:
 	WebServer server_;
 	DNSServer dns_server_;
 
+	// Networks of the last background scan, strongest first, as the JSON array served by /config
+	String networks_json_;
+	uint32_t last_scan_;
+
+	// Credentials being tried, checked from doLoop
+	enum class connect_state
+	{
+		idle,
+		connecting,
+		connected,
+		failed
+	};
+	connect_state connect_state_;
+	uint32_t connect_started_;
+
 	void handle_unknown();
 	void handle_root_get();
+	void handle_config();
 	void handle_root_post();
+	void handle_status();
+
+	void update_scan();
+	void update_connect();
+
+	wl_status_t wait_connected(uint32_t timeout_ms);
+	bool fast_connect();
+	void save_connection();
 
 public:
 	wifi_provisioning(const String &instance_name, const String& base_url = "/provisioning");
+	// Tries the access point, channel and IP configuration of the last connection first,
+	// then falls back to a full scan
 	wl_status_t connect(int seconds = 30);
 
 	void start_portal(const String &ap_password = "");
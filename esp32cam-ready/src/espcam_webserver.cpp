@@ -1,18 +1,38 @@
+#include <algorithm>
 #include <esp32-hal-log.h>
 #include <espcam_webserver.h>
 #include <ESPmDNS.h>
+#include <time.h>
+#include <iov_writer.h>
+#include <metrics.h>
+#include "index_html.h"
 
-espcam_webserver::espcam_webserver(OV2640 &cam, const String &instance_name)
-	: instance_name_(instance_name), cam_(cam), rtsp_server_(cam)
+// Frame rate of the streams in motion triggered mode while nothing moves
+static const uint32_t idle_frame_rate = 1;
+
+espcam_webserver::espcam_webserver(camera_capture &capture, const String &instance_name, uint32_t snapshot_max_age_ms /*= 1000*/)
+	: instance_name_(instance_name), capture_(capture), ladder_(capture), last_ladder_update_(0), rtsp_server_(capture), mjpeg_streamer_(capture),
+	  motion_detector_(capture), recorder_(capture), frame_rate_(rtsp_server_.frame_rate()), idle_rate_(false), first_frame_(0), snapshot_max_age_ms_(snapshot_max_age_ms)
 {
 	// Set up required URL handlers on the web server
 	server_.on("/", HTTP_GET, std::bind(&espcam_webserver::handle_root, this));
+	server_.on("/config", HTTP_GET, std::bind(&espcam_webserver::handle_config, this));
 	server_.on("/reset", HTTP_GET, std::bind(&espcam_webserver::handle_reset, this));
 	server_.on("/stream", HTTP_GET, std::bind(&espcam_webserver::handle_jpg_stream, this));
 	server_.on("/jpg", HTTP_GET, std::bind(&espcam_webserver::handle_jpg, this));
 	server_.on("/lighton", HTTP_GET, std::bind(&espcam_webserver::handle_light_on, this));
 	server_.on("/lightoff", HTTP_GET, std::bind(&espcam_webserver::handle_light_off, this));
 	server_.on("/lightstatus", HTTP_GET, std::bind(&espcam_webserver::handle_light_status, this));
+	server_.on("/framerate", HTTP_GET, std::bind(&espcam_webserver::handle_frame_rate, this));
+	server_.on("/motion", HTTP_GET, std::bind(&espcam_webserver::handle_motion, this));
+	server_.on("/recordings", HTTP_GET, std::bind(&espcam_webserver::handle_recordings, this));
+	server_.on("/clip", HTTP_GET, std::bind(&espcam_webserver::handle_clip, this));
+	server_.on("/stats", HTTP_GET, std::bind(&espcam_webserver::handle_stats, this));
+	server_.on("/metrics", HTTP_GET, std::bind(&espcam_webserver::handle_metrics, this));
+
+	// Request headers needed for conditional GET on / and /jpg
+	static const char *headers[] = {"If-None-Match", "If-Modified-Since"};
+	server_.collectHeaders(headers, sizeof(headers) / sizeof(headers[0]));
 }
 
 void espcam_webserver::begin()
@@ -20,6 +40,12 @@ void espcam_webserver::begin()
 	log_i("Starting rtsp_server");
 	rtsp_server_.begin();
 
+	if (!motion_detector_.begin())
+		log_e("Starting the motion detection task failed");
+
+	if (!recorder_.begin())
+		log_w("Not recording to SD card");
+
 	log_i("Starting web server");
 	server_.begin();
 
@@ -30,44 +56,110 @@ void espcam_webserver::begin()
 
 void espcam_webserver::doLoop()
 {
+	auto start = micros();
 	rtsp_server_.doLoop();
+	mjpeg_streamer_.doLoop();
+	recorder_.doLoop();
 	server_.handleClient();
+
+	if (first_frame_ == 0 && metrics.rtsp_frames_sent.value() + metrics.mjpeg_frames_sent.value() > 0)
+	{
+		first_frame_ = millis();
+		log_i("First frame sent %lu ms after boot", first_frame_);
+	}
+
+	// Give an expired snapshot back to the capture ring
+	if (snapshot_ && !snapshot_valid())
+		snapshot_.reset();
+
+	// Motion triggered mode: streams drop to the idle rate while nothing moves
+	if (idle_rate_ != (motion_detector_.enabled() && !motion_detector_.motion()))
+		apply_frame_rate();
+
+	// Adapt resolution and quality to the clients once a second
+	auto now = millis();
+	if (now - last_ladder_update_ >= 1000)
+	{
+		last_ladder_update_ = now;
+		ladder_.update(rtsp_server_.clients() + mjpeg_streamer_.subscribers(),
+					   rtsp_server_.congested() || mjpeg_streamer_.congested(),
+					   rtsp_server_.clients() > 0);
+	}
+
+	metrics.loop_time.observe(micros() - start);
+}
+
+// Optional query parameters: framesize (qqvga .. uxga, or auto) and quality (0-63, lower is better)
+bool espcam_webserver::apply_format_args()
+{
+	if (!server_.hasArg("framesize") && !server_.hasArg("quality"))
+		return true;
+
+	if (server_.arg("framesize") == "auto")
+	{
+		ladder_.set_automatic();
+		return true;
+	}
+
+	auto frame_size = capture_.frame_size();
+	if (server_.hasArg("framesize") && !quality_ladder::parse_frame_size(server_.arg("framesize"), frame_size))
+		return false;
+
+	auto quality = capture_.quality();
+	if (server_.hasArg("quality"))
+	{
+		quality = server_.arg("quality").toInt();
+		if (quality < 0 || quality > 63)
+			return false;
+	}
+
+	ladder_.set(frame_size, quality, rtsp_server_.clients() > 0);
+	return true;
+}
+
+void espcam_webserver::apply_frame_rate()
+{
+	idle_rate_ = motion_detector_.enabled() && !motion_detector_.motion();
+	rtsp_server_.set_frame_rate(idle_rate_ ? idle_frame_rate : frame_rate_);
+	mjpeg_streamer_.set_frame_interval(idle_rate_ ? 1000 / idle_frame_rate : 0);
+}
+
+bool espcam_webserver::snapshot_valid() const
+{
+	return snapshot_ && millis() - snapshot_->timestamp < snapshot_max_age_ms_;
+}
+
+// The streamer or recorder keeps its own copy of the client, which shares the socket. Stopping the
+// server's copy only drops its reference, so WebServer sees the request closed and goes on with the
+// next client instead of waiting up to 2 s in HC_WAIT_CLOSE
+void espcam_webserver::release_client()
+{
+	server_.client().stop();
 }
 
 void espcam_webserver::handle_root()
 {
 	log_i("handle_root");
-	String html(
-		"<!DOCTYPE html>"
-		"<html lang=\"en\">"
-		"<head>"
-		"<meta name=\"viewport\" content=\"width=device-width, initial-scale=1, shrink-to-fit=no\"/>"
-		"<meta http-equiv=\"Pragma\" content=\"no-cache\">"
-		"<link rel=\"stylesheet\" href=\"https://stackpath.bootstrapcdn.com/bootstrap/4.3.1/css/bootstrap.min.css\">"
-		"<title>"
-		"ESP32 CAM"
-		"</title>"
-		"</head>"
-		"<body>"
-		"<div class=\"container\">"
-		"<h2 class=\"text-center\">ESP32CAM</h2>"
-		"<div class=\"alert alert-primary\" role=\"alert\">"
-		"rtsp stream available at: <a class=\"alert-link\" href=\"rtsp://" +
-		instance_name_ + ".local:554/mjpeg/1\">rtsp://" + instance_name_ + ".local:554/mjpeg/1</a>"
-																		   "</div>"
-																		   "<div class=\"list-group\">"
-																		   "<button type=\"button\" class=\"list-group-item list-group-item-action active\">Options</button>"
-																		   "<a class=\"list-group-item list-group-item-action\" href=\"jpg\">Single frame</a>"
-																		   "<a class=\"list-group-item list-group-item-action\" href=\"stream\">Stream frames</a>"
-																		   "<a class=\"list-group-item list-group-item-action\" href=\"lighton\">Light on</a>"
-																		   "<a class=\"list-group-item list-group-item-action\" href=\"lightoff\">Light off</a>"
-																		   "<a class=\"list-group-item list-group-item-action list-group-item-danger\" href=\"reset\">Reset configuration and restart</a>"
-																		   "</div>"
-																		   "</div>"
-																		   "</body>"
-																		   "</html>");
-
-	server_.send(200, "text/html", html);
+	// The page is static, instance specific values come from /config
+	server_.sendHeader("ETag", index_html_etag);
+	server_.sendHeader("Cache-Control", "no-cache");
+	if (server_.header("If-None-Match") == index_html_etag)
+	{
+		// Not Modified
+		server_.send(304);
+		return;
+	}
+
+	server_.sendHeader("Content-Encoding", "gzip");
+	server_.send_P(200, "text/html", reinterpret_cast<const char *>(index_html_gz), index_html_gz_len);
+}
+
+void espcam_webserver::handle_config()
+{
+	log_i("handle_config");
+	server_.send(200, "application/json", "{\"name\":\"" + instance_name_ + "\","
+										  "\"rtsp\":\"rtsp://" + instance_name_ + ".local:554/mjpeg/1\","
+										  "\"fps\":" + String(frame_rate_) + "}");
 }
 
 void espcam_webserver::handle_reset()
@@ -80,35 +172,91 @@ void espcam_webserver::handle_reset()
 void espcam_webserver::handle_jpg_stream()
 {
 	log_i("handle_jpg_stream");
-	server_.sendContent("HTTP/1.1 200 OK\r\n"
-						"Content-Type: multipart/x-mixed-replace; boundary=frame\r\n\r\n");
+	if (!apply_format_args())
+	{
+		server_.send(400, "text/plain", "400: Invalid Request");
+		return;
+	}
 
-	auto wifi_client = server_.client();
-	do
+	// Frames are sent incrementally from doLoop so other requests are not blocked
+	if (!mjpeg_streamer_.add(server_.client()))
 	{
-		cam_.run();
-		if (!wifi_client.connected())
-			break;
+		server_.send(503, "text/plain", "503: Too many streams");
+		return;
+	}
 
-		server_.sendContent("--frame\r\n"
-							"Content-Type: image/jpeg\r\n\r\n");
-		wifi_client.write(reinterpret_cast<char *>(cam_.getfb()), cam_.getSize());
-		server_.sendContent("\r\n");
-	} while (wifi_client.connected());
+	release_client();
 }
 
 void espcam_webserver::handle_jpg()
 {
 	log_i("handle_jpg");
+	auto format_args = server_.hasArg("framesize") || server_.hasArg("quality");
+	if (!apply_format_args())
+	{
+		server_.send(400, "text/plain", "400: Invalid Request");
+		return;
+	}
+
+	// Serve the cached snapshot unless it expired or another format was requested
+	if (snapshot_valid() && !format_args)
+		metrics.snapshot_hits.inc();
+	else
+	{
+		metrics.snapshot_misses.inc();
+		snapshot_.reset();
+		snapshot_ = capture_.next();
+		if (!snapshot_)
+		{
+			server_.send(503, "text/plain", "503: No frame available");
+			return;
+		}
+	}
+
+	char etag[16];
+	snprintf(etag, sizeof(etag), "\"%08x\"", snapshot_->sequence);
+
+	auto age = millis() - snapshot_->timestamp;
+	auto max_age = age < snapshot_max_age_ms_ ? (snapshot_max_age_ms_ - age) / 1000 : 0;
+
+	// Only when the clock was set, e.g. by SNTP
+	char last_modified[32] = "";
+	auto now = time(nullptr);
+	if (now > 1600000000)
+	{
+		time_t modified = now - age / 1000;
+		strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&modified));
+	}
+
+	if (server_.header("If-None-Match") == etag || (*last_modified && server_.header("If-Modified-Since") == last_modified))
+	{
+		server_.sendHeader("ETag", etag);
+		server_.sendHeader("Cache-Control", "max-age=" + String(max_age));
+		// Not Modified
+		server_.send(304);
+		return;
+	}
+
 	auto wifi_client = server_.client();
-	cam_.run();
 	if (!wifi_client.connected())
 		return;
 
-	server_.sendContent("HTTP/1.1 200 OK\r\n"
-						"Content-Disposition: inline; filename=capture.jpg\r\n"
-						"Content-Type: image/jpeg\r\n\r\n");
-	wifi_client.write(reinterpret_cast<const char *>(cam_.getfb()), cam_.getSize());
+	char headers[256];
+	auto headers_size = snprintf(headers, sizeof(headers), "HTTP/1.1 200 OK\r\n"
+														   "Content-Disposition: inline; filename=capture.jpg\r\n"
+														   "Content-Type: image/jpeg\r\n"
+														   "Content-Length: %u\r\n"
+														   "Cache-Control: max-age=%u\r\n"
+														   "ETag: %s\r\n"
+														   "%s%s%s"
+														   "\r\n",
+								 snapshot_->size, max_age, etag, *last_modified ? "Last-Modified: " : "", last_modified, *last_modified ? "\r\n" : "");
+	// Headers and frame in one scatter/gather write, straight from the capture buffer
+	iov_writer writer;
+	writer.add(headers, headers_size);
+	writer.add(snapshot_->data, snapshot_->size);
+	if (!writer.send_all(wifi_client.fd()))
+		log_w("Sending snapshot failed after %u of %u bytes", writer.sent(), writer.total());
 }
 
 void espcam_webserver::handle_light_on()
@@ -138,3 +286,151 @@ void espcam_webserver::handle_light_status()
 
 	server_.send(200, "text/html", on ? "1" : "0");
 }
+
+void espcam_webserver::handle_frame_rate()
+{
+	log_i("handle_frame_rate");
+	long fps;
+	if (!server_.hasArg("fps") || (fps = server_.arg("fps").toInt()) <= 0)
+	{
+		server_.send(400, "text/plain", "400: Invalid Request");
+		return;
+	}
+
+	frame_rate_ = std::max<uint32_t>(1, std::min<uint32_t>(fps, 30));
+	apply_frame_rate();
+
+	server_.sendHeader("Location", "/");
+	// See Other
+	server_.send(302);
+}
+
+// Optional query parameters: enabled (0 or 1) and threshold (1-255, mean luma difference per cell)
+void espcam_webserver::handle_motion()
+{
+	log_i("handle_motion");
+	long threshold = motion_detector_.threshold();
+	if (server_.hasArg("threshold") && ((threshold = server_.arg("threshold").toInt()) < 1 || threshold > 255))
+	{
+		server_.send(400, "text/plain", "400: Invalid Request");
+		return;
+	}
+
+	motion_detector_.set_threshold(threshold);
+	if (server_.hasArg("enabled"))
+		motion_detector_.set_enabled(server_.arg("enabled") == "1");
+
+	apply_frame_rate();
+
+	auto last_motion = motion_detector_.events() ? String(millis() - motion_detector_.last_motion()) : String("null");
+	server_.send(200, "application/json", "{\"enabled\":" + String(motion_detector_.enabled() ? "true" : "false") +
+											  ",\"motion\":" + String(motion_detector_.motion() ? "true" : "false") +
+											  ",\"score\":" + String(motion_detector_.score()) +
+											  ",\"threshold\":" + String(motion_detector_.threshold()) +
+											  ",\"events\":" + String(motion_detector_.events()) +
+											  ",\"last_motion_ms_ago\":" + last_motion + "}");
+}
+
+void espcam_webserver::handle_recordings()
+{
+	log_i("handle_recordings");
+	// Ages in seconds, so clips can be requested without a set clock
+	auto now = millis();
+	String json("{\"recording\":" + String(recorder_.recording() ? "true" : "false") + ",\"segments\":[");
+	auto separator = "";
+	for (const auto &segment : recorder_.segments())
+	{
+		char entry[96];
+		snprintf(entry, sizeof(entry), "%s{\"from_seconds_ago\":%u,\"to_seconds_ago\":%u,\"bytes\":%u}",
+				 separator, (now - segment.start) / 1000, (now - segment.end) / 1000, segment.length);
+		json += entry;
+		separator = ",";
+	}
+
+	json += "]}";
+	server_.send(200, "application/json", json);
+}
+
+// Query parameters: ago (seconds before now where the clip starts, default 60) and duration (seconds, default up to now)
+void espcam_webserver::handle_clip()
+{
+	log_i("handle_clip");
+	auto ago = server_.hasArg("ago") ? server_.arg("ago").toInt() : 60;
+	auto duration = server_.hasArg("duration") ? server_.arg("duration").toInt() : ago;
+	auto now = millis();
+	if (ago <= 0 || duration <= 0 || static_cast<uint32_t>(ago) * 1000 > now)
+	{
+		server_.send(400, "text/plain", "400: Invalid Request");
+		return;
+	}
+
+	// Frames are sent incrementally from doLoop so other requests are not blocked
+	auto start = now - ago * 1000;
+	if (!recorder_.add_clip(server_.client(), start, start + duration * 1000))
+	{
+		server_.send(404, "text/plain", "404: No recording in this range");
+		return;
+	}
+
+	release_client();
+}
+
+void espcam_webserver::handle_stats()
+{
+	log_i("handle_stats");
+	String json("{\"target_fps\":" + String(rtsp_server_.frame_rate()) + ",\"clients\":[");
+	auto separator = "";
+	for (const auto &stats : rtsp_server_.stats())
+	{
+		char client[224];
+		snprintf(client, sizeof(client), "%s{\"address\":\"%s\",\"msec_per_frame\":%u,\"fps\":%.1f,\"bytes_per_second\":%u,\"frames\":%u,\"dropped\":%u,\"stalls\":%u,\"deadline_misses\":%u}",
+				 separator, stats.address.toString().c_str(), stats.msec_per_frame, stats.fps, stats.bytes_per_second, stats.frames, stats.dropped, stats.stalls, stats.deadline_misses);
+		json += client;
+		separator = ",";
+	}
+
+	json += "],\"snapshot\":{\"max_age_ms\":" + String(snapshot_max_age_ms_) + ",\"hits\":" + String(metrics.snapshot_hits.value()) + ",\"misses\":" + String(metrics.snapshot_misses.value()) + "}}";
+	server_.send(200, "application/json", json);
+}
+
+void espcam_webserver::handle_metrics()
+{
+	log_i("handle_metrics");
+	String out;
+	out.reserve(4096);
+	metrics.write(out);
+
+	write_gauge(out, "esp32cam_rtsp_clients", "Connected RTSP clients", rtsp_server_.clients());
+	write_gauge(out, "esp32cam_mjpeg_subscribers", "Connected MJPEG stream subscribers", mjpeg_streamer_.subscribers());
+	write_gauge(out, "esp32cam_boot_to_first_frame_milliseconds", "Time from boot until the first frame went out to a client, 0 until then", first_frame_);
+	write_gauge(out, "esp32cam_motion", "1 while motion is detected", motion_detector_.motion());
+	write_gauge(out, "esp32cam_motion_score", "Mean absolute luma difference per cell of the last motion sample", motion_detector_.score());
+	write_counter(out, "esp32cam_motion_events_total", "Transitions from no motion to motion", motion_detector_.events());
+
+	// Per client, labelled with the client address
+	static const char *const families[][3] = {
+		{"esp32cam_rtsp_client_fps", "gauge", "Frames per second sent to the client"},
+		{"esp32cam_rtsp_client_bytes_per_second", "gauge", "Bytes per second sent to the client"},
+		{"esp32cam_rtsp_client_frames_total", "counter", "Frames sent to the client"},
+		{"esp32cam_rtsp_client_dropped_total", "counter", "Frames skipped because the client was congested"},
+		{"esp32cam_rtsp_client_stalls_total", "counter", "Frame writes to the client slower than half the interval"},
+		{"esp32cam_rtsp_client_deadline_misses_total", "counter", "Frame deadlines of the client served late or not at all"},
+	};
+	auto stats = rtsp_server_.stats();
+	char value[32];
+	for (size_t family = 0; family < sizeof(families) / sizeof(families[0]); ++family)
+	{
+		write_header(out, families[family][0], families[family][2], families[family][1]);
+		for (const auto &client : stats)
+		{
+			const double values[] = {client.fps, static_cast<double>(client.bytes_per_second), static_cast<double>(client.frames), static_cast<double>(client.dropped), static_cast<double>(client.stalls), static_cast<double>(client.deadline_misses)};
+			out += families[family][0];
+			out += "{client=\"";
+			out += client.address.toString();
+			snprintf(value, sizeof(value), "\"} %g\n", values[family]);
+			out += value;
+		}
+	}
+
+	server_.send(200, "text/plain; version=0.0.4", out);
+}
@@ -1,28 +1,58 @@
 #pragma once
 
 #include <WebServer.h>
-#include <OV2640.h>
+#include <camera_capture.h>
+#include <quality_ladder.h>
 #include <rtsp_server.h>
+#include <mjpeg_streamer.h>
+#include <motion_detector.h>
+#include <recorder.h>
 
 class espcam_webserver
 {
 private:
 	const String &instance_name_;
-	OV2640 &cam_;
+	camera_capture &capture_;
+	quality_ladder ladder_;
+	uint32_t last_ladder_update_;
 	rtsp_server rtsp_server_;
+	mjpeg_streamer mjpeg_streamer_;
+	motion_detector motion_detector_;
+	recorder recorder_;
+	// RTSP rate set by the user, applied while there is motion or motion detection is off
+	uint32_t frame_rate_;
+	bool idle_rate_;
+	// millis() when the first frame went out to a client, 0 until then
+	uint32_t first_frame_;
+
+	// Snapshot served by /jpg until it is older than the max age
+	camera_capture::frame_ptr snapshot_;
+	uint32_t snapshot_max_age_ms_;
 
 	WebServer server_;
 
+	bool apply_format_args();
+	bool snapshot_valid() const;
+	void apply_frame_rate();
+	void release_client();
+
 	void handle_root();
+	void handle_config();
 	void handle_reset();
 	void handle_jpg_stream();
 	void handle_jpg();
 	void handle_light_on();
 	void handle_light_off();
 	void handle_light_status();
+	void handle_frame_rate();
+	void handle_motion();
+	void handle_recordings();
+	void handle_clip();
+	void handle_stats();
+	void handle_metrics();
 
 public:
-	espcam_webserver(OV2640 &cam, const String &instance_name);
+	espcam_webserver(camera_capture &capture, const String &instance_name, uint32_t snapshot_max_age_ms = 1000);
 	void begin();
 	void doLoop();
 };
@@ -6,6 +6,7 @@
 #include <espcam_webserver.h>
 
 #include <OV2640.h>
+#include <camera_capture.h>
 
 #include "soc/rtc_cntl_reg.h"
 
@@ -22,8 +23,14 @@ String get_mac_address()
 
 auto instance_name = String(app_name) + "-" + get_mac_address();
 
+// Ring slots: one being filled, the latest frame, then one each held by the /jpg snapshot,
+// the recorder while writing, the motion detector while decoding and the RTSP send,
+// and one per MJPEG subscriber
+const size_t capture_slots = 6 + mjpeg_streamer::max_subscribers;
+
 OV2640 cam;
-espcam_webserver espcam_web(cam, instance_name);
+camera_capture capture(cam, capture_slots);
+espcam_webserver espcam_web(capture, instance_name);
 
 // put your setup code here, to run once:
 void setup()
@@ -42,9 +49,12 @@ void setup()
 	digitalWrite(LED_BUILTIN, false);
 
 	log_i("Initialize the camera");
+	// Buffers are allocated for the largest frame size, the quality ladder can only go down from here
 	esp32cam_aithinker_config.frame_size = FRAMESIZE_UXGA;
 	if (cam.init(esp32cam_aithinker_config) != ESP_OK)
 		log_e("Initializing the camera failed");
+	else if (!capture.begin())
+		log_e("Starting the capture task failed");
 
 	log_i("Instance_name: %s", instance_name.c_str());
 
@@ -0,0 +1,50 @@
+#include <unity.h>
+#include <frame_diff.h>
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_equal_arrays()
+{
+	const uint8_t a[] = {0, 17, 128, 255};
+	TEST_ASSERT_EQUAL_UINT32(0, sum_abs_diff(a, a, sizeof(a)));
+}
+
+void test_differences_in_both_directions()
+{
+	const uint8_t a[] = {10, 200, 0, 255};
+	const uint8_t b[] = {20, 100, 255, 0};
+	TEST_ASSERT_EQUAL_UINT32(10 + 100 + 255 + 255, sum_abs_diff(a, b, sizeof(a)));
+	TEST_ASSERT_EQUAL_UINT32(10 + 100 + 255 + 255, sum_abs_diff(b, a, sizeof(a)));
+}
+
+void test_empty()
+{
+	const uint8_t a[] = {1};
+	TEST_ASSERT_EQUAL_UINT32(0, sum_abs_diff(a, a, 0));
+}
+
+void test_full_motion_grid()
+{
+	// A 32x24 grid going from black to white, the largest score the motion detector sees
+	static uint8_t black[32 * 24];
+	static uint8_t white[32 * 24];
+	for (size_t i = 0; i < sizeof(white); ++i)
+		white[i] = 255;
+	TEST_ASSERT_EQUAL_UINT32(255u * sizeof(white), sum_abs_diff(black, white, sizeof(white)));
+}
+
+int main()
+{
+	UNITY_BEGIN();
+	RUN_TEST(test_equal_arrays);
+	RUN_TEST(test_differences_in_both_directions);
+	RUN_TEST(test_empty);
+	RUN_TEST(test_full_motion_grid);
+	return UNITY_END();
+}
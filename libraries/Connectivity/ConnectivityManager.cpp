@@ -0,0 +1,122 @@
+#include "ConnectivityManager.h"
+#include <WiFi.h>
+
+ConnectivityManager::ConnectivityManager(uint32_t minBackoffMs, uint32_t maxBackoffMs, uint32_t wifiTimeoutMs)
+    : minBackoffMs_(minBackoffMs), maxBackoffMs_(maxBackoffMs), wifiTimeoutMs_(wifiTimeoutMs),
+      ssid_(nullptr), password_(nullptr), state_(BACKOFF), stateSince_(0), backoffMs_(0), failures_(0),
+      lostAt_(0), reconnects_(0), lastReconnectMs_(0)
+{
+}
+
+void ConnectivityManager::begin(const char *ssid, const char *password)
+{
+  ssid_ = ssid;
+  password_ = password;
+  WiFi.mode(WIFI_STA);
+  // Reconnecting is done here, with backoff
+  WiFi.setAutoReconnect(false);
+  startWiFi();
+}
+
+void ConnectivityManager::setService(ConnectFunction connect, ConnectedFunction connected)
+{
+  connect_ = connect;
+  serviceConnected_ = connected;
+}
+
+const char *ConnectivityManager::stateName(State state)
+{
+  switch (state)
+  {
+  case WIFI_CONNECTING:
+    return "wifi connecting";
+  case SERVICE_CONNECTING:
+    return "service connecting";
+  case CONNECTED:
+    return "connected";
+  default:
+    return "backoff";
+  }
+}
+
+void ConnectivityManager::loop()
+{
+  uint32_t now = millis();
+  switch (state_)
+  {
+  case WIFI_CONNECTING:
+    if (WiFi.status() == WL_CONNECTED)
+      setState(SERVICE_CONNECTING);
+    else if (now - stateSince_ > wifiTimeoutMs_)
+      fail();
+    break;
+
+  case SERVICE_CONNECTING:
+    if (WiFi.status() != WL_CONNECTED)
+      fail();
+    else if (!connect_ || connect_())
+    {
+      failures_ = 0;
+      if (lostAt_ != 0)
+      {
+        reconnects_++;
+        lastReconnectMs_ = millis() - lostAt_;
+        lostAt_ = 0;
+      }
+      setState(CONNECTED);
+    }
+    else
+      fail();
+    break;
+
+  case CONNECTED:
+    if (WiFi.status() != WL_CONNECTED)
+    {
+      lostAt_ = now;
+      startWiFi();
+    }
+    else if (serviceConnected_ && !serviceConnected_())
+    {
+      lostAt_ = now;
+      setState(SERVICE_CONNECTING);
+    }
+    break;
+
+  case BACKOFF:
+    if (now - stateSince_ >= backoffMs_)
+    {
+      if (WiFi.status() == WL_CONNECTED)
+        setState(SERVICE_CONNECTING);
+      else
+        startWiFi();
+    }
+    break;
+  }
+}
+
+void ConnectivityManager::setState(State state)
+{
+  State from = state_;
+  state_ = state;
+  stateSince_ = millis();
+  if (callback_ && from != state)
+    callback_(from, state);
+}
+
+void ConnectivityManager::startWiFi()
+{
+  WiFi.disconnect();
+  WiFi.begin(ssid_, password_);
+  setState(WIFI_CONNECTING);
+}
+
+// Wait min * 2^failures, capped, with "equal jitter": half fixed, half random
+void ConnectivityManager::fail()
+{
+  uint32_t backoff = minBackoffMs_ << (failures_ < 16 ? failures_ : 16);
+  if (backoff > maxBackoffMs_ || backoff < minBackoffMs_)
+    backoff = maxBackoffMs_;
+  failures_++;
+  backoffMs_ = backoff / 2 + esp_random() % (backoff / 2 + 1);
+  setState(BACKOFF);
+}
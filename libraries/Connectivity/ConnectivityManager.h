@@ -0,0 +1,70 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+/***** Non-blocking Wi-Fi plus service (MQTT, HTTP, ...) connection state machine *****/
+
+/* Call loop() from the main loop. It never waits for Wi-Fi: Wi-Fi is started and then polled,
+ * and failures are retried after an exponential backoff with jitter so a fleet of devices does
+ * not reconnect in lockstep. The service connect function gets one attempt per call and runs
+ * inline, so that call blocks for as long as the attempt does: PubSubClient::connect waits for
+ * the TCP connect and then up to its socket timeout (15 s by default) for CONNACK. Keep that
+ * timeout short with setSocketTimeout() when loop() has other work to do.
+ */
+class ConnectivityManager
+{
+public:
+  enum State
+  {
+    WIFI_CONNECTING,
+    SERVICE_CONNECTING,
+    CONNECTED,
+    BACKOFF
+  };
+
+  // One connection attempt, e.g. PubSubClient::connect; blocks loop() while it runs. Returns true when connected
+  typedef std::function<bool()> ConnectFunction;
+  // Whether the service is still connected, e.g. PubSubClient::connected
+  typedef std::function<bool()> ConnectedFunction;
+  typedef std::function<void(State from, State to)> StateCallback;
+
+  ConnectivityManager(uint32_t minBackoffMs = 1000, uint32_t maxBackoffMs = 60000, uint32_t wifiTimeoutMs = 15000);
+
+  void begin(const char *ssid, const char *password);
+  // Without a service, CONNECTED means Wi-Fi is up
+  void setService(ConnectFunction connect, ConnectedFunction connected);
+  void onStateChange(StateCallback callback) { callback_ = callback; }
+
+  void loop();
+
+  State state() const { return state_; }
+  bool connected() const { return state_ == CONNECTED; }
+  // Reconnects after a loss and the time the last one took
+  uint32_t reconnects() const { return reconnects_; }
+  uint32_t lastReconnectMs() const { return lastReconnectMs_; }
+  static const char *stateName(State state);
+
+private:
+  uint32_t minBackoffMs_;
+  uint32_t maxBackoffMs_;
+  uint32_t wifiTimeoutMs_;
+  const char *ssid_;
+  const char *password_;
+  ConnectFunction connect_;
+  ConnectedFunction serviceConnected_;
+  StateCallback callback_;
+
+  State state_;
+  uint32_t stateSince_;
+  uint32_t backoffMs_;
+  uint32_t failures_;
+  // millis() when the connection was lost, 0 while connected or before the first connection
+  uint32_t lostAt_;
+  uint32_t reconnects_;
+  uint32_t lastReconnectMs_;
+
+  void setState(State state);
+  void startWiFi();
+  void fail();
+};